@@ -0,0 +1,147 @@
+#include <map>
+#include <iostream>
+#include "rayAccelerator.h"
+#include "parallel.h"
+
+using namespace std;
+
+// Registry of the acceleration structures, by the id that the p3f accel command selects.
+// The backends of the ray tracer are registered on the first lookup, so the registry never
+// depends on the order in which the translation units are initialized.
+
+struct AcceleratorEntry {
+	const char* name;
+	AcceleratorFactory factory;
+};
+
+static Accelerator* create_grid(void) { return new Grid(); }
+
+static Accelerator* create_bvh(void) { return new BVH(); }
+
+static Accelerator* create_lbvh(void) {
+	BVH* bvh = new BVH();
+	bvh->setBuilder(BVH_BUILDER_LINEAR);
+	return bvh;
+}
+
+static Accelerator* create_sbvh(void) {
+	BVH* bvh = new BVH();
+	bvh->setBuilder(BVH_BUILDER_SPATIAL);
+	return bvh;
+}
+
+static Accelerator* create_kdtree(void) { return new KdTree(); }
+
+static map<int, AcceleratorEntry>& registry(void) {
+	static map<int, AcceleratorEntry> entries;
+	static bool builtin = false;
+
+	if (!builtin) {
+		builtin = true;
+		entries[GRID_ACC] = { "grid", create_grid };
+		entries[BVH_ACC] = { "BVH", create_bvh };
+		entries[LBVH_ACC] = { "BVH (linear builder)", create_lbvh };
+		entries[SBVH_ACC] = { "BVH (spatial splits)", create_sbvh };
+		entries[KD_ACC] = { "kd-tree", create_kdtree };
+	}
+	return entries;
+}
+
+bool registerAccelerator(int id, const char* name, AcceleratorFactory factory) {
+	map<int, AcceleratorEntry>& entries = registry();
+
+	if (id == NONE || factory == NULL || entries.count(id) > 0) return false;
+
+	entries[id] = { name, factory };
+	return true;
+}
+
+Accelerator* createAccelerator(int id) {
+	map<int, AcceleratorEntry>& entries = registry();
+	map<int, AcceleratorEntry>::iterator entry = entries.find(id);
+
+	return entry == entries.end() ? NULL : entry->second.factory();
+}
+
+const char* getAcceleratorName(int id) {
+	map<int, AcceleratorEntry>& entries = registry();
+	map<int, AcceleratorEntry>::iterator entry = entries.find(id);
+
+	return entry == entries.end() ? "none" : entry->second.name;
+}
+
+// --------------------------------------------------------------------- primitives
+// Fails, with nothing stored, if the objects have more primitives of one type than a PrimRef
+// can index: the structure is then left empty instead of testing the wrong primitives.
+bool Accelerator::store_primitives(vector<Object*>& objs) {
+	prims.clear();
+	refs.clear();
+	refs.reserve(objs.size());
+
+	for (Object* obj : objs)
+		refs.push_back(prims.add(obj));
+
+	if (prims.isOverflowed()) {
+		cerr << "Too many primitives of one type: an acceleration structure holds at most " << (1u << PRIM_INDEX_BITS) << " of each.\n";
+		prims.clear();
+		refs.clear();
+		refs.shrink_to_fit();
+		return false;
+	}
+
+	refs.shrink_to_fit();
+	return true;
+}
+
+// --------------------------------------------------------------------- bounds
+AABB Accelerator::store_bounds(vector<Object*>& objs) {
+	int n_chunks = objs.size() >= ACCEL_PARALLEL_BOUNDS ? num_threads() : 1;
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	AABB world_bbox = AABB(min, max);
+	vector<AABB> chunk_bbox(n_chunks, world_bbox);
+
+	bounds.resize(objs.size());
+
+	parallel_for(0, objs.size(), n_chunks, [&](int chunk, int first, int last) {
+		for (int i = first; i < last; i++) {
+			bounds[i] = objs[i]->GetBoundingBox();
+			chunk_bbox[chunk].extend(bounds[i]);
+		}
+	});
+
+	for (AABB& bbox : chunk_bbox)
+		world_bbox.extend(bbox);
+
+	return world_bbox;
+}
+
+void Accelerator::free_bounds(void) {
+	bounds.clear();
+	bounds.shrink_to_fit();
+}
+
+// --------------------------------------------------------------------- unbounded objects
+void Accelerator::split_unbounded(vector<Object*>& objs, vector<Object*>& bounded) {
+	unbounded.clear();
+	bounded.clear();
+	bounded.reserve(objs.size());
+
+	for (Object* obj : objs) {
+		if (obj->isBounded()) bounded.push_back(obj);
+		else unbounded.push_back(obj);
+	}
+}
+
+void Accelerator::intercepts_unbounded(Ray& ray, HitRecord& hit) {
+	for (Object* obj : unbounded)
+		obj->intercepts(ray, hit);
+}
+
+bool Accelerator::intercepts_unbounded(Ray& ray, float length) {
+	float t;
+
+	for (Object* obj : unbounded)
+		if (obj->intercepts(ray, t) && t < length) return true;
+
+	return false;
+}
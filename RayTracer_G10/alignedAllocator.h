@@ -0,0 +1,34 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <xmmintrin.h>
+
+// STL allocator returning memory aligned to Alignment bytes, so that arrays of
+// acceleration structure nodes start on a cache line (vector<T, AlignedAllocator<T, 64> >)
+
+template <class T, size_t Alignment>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+
+	template <class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator(void) {}
+	template <class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t n) {
+		void* p = _mm_malloc(n * sizeof(T), Alignment);
+		if (p == NULL) throw std::bad_alloc();
+		return (T*)p;
+	}
+
+	void deallocate(T* p, size_t) { _mm_free(p); }
+
+	template <class U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+	template <class U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+#endif
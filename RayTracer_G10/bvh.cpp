@@ -1,84 +1,225 @@
 #include "rayAccelerator.h"
 #include "macros.h"
+#include "parallel.h"
+#include <cassert>
 
 using namespace std;
 
-BVH::BVHNode::BVHNode(void) {}
+void BVH::BVHNode::setAABB(AABB& bbox_) {
+	bmin[0] = bbox_.min.x; bmin[1] = bbox_.min.y; bmin[2] = bbox_.min.z;
+	bmax[0] = bbox_.max.x; bmax[1] = bbox_.max.y; bmax[2] = bbox_.max.z;
+}
 
-void BVH::BVHNode::setAABB(AABB& bbox_) { this->bbox = bbox_; }
+AABB BVH::BVHNode::getAABB() {
+	return AABB(Vector(bmin[0], bmin[1], bmin[2]), Vector(bmax[0], bmax[1], bmax[2]));
+}
 
 void BVH::BVHNode::makeLeaf(unsigned int index_, unsigned int n_objs_) {
-	this->leaf = true;
 	this->index = index_; 
 	this->n_objs = n_objs_; 
 }
 
 void BVH::BVHNode::makeNode(unsigned int left_index_) {
-	this->leaf = false;
 	this->index = left_index_; 
-	//this->n_objs = n_objs_; 
+	this->n_objs = 0;
 }
 
-
 BVH::BVH(void) {}
 
 int BVH::getNumObjects() { return objects.size(); }
 
+void BVH::setLeafSize(int leaf_size_) { this->leaf_size = leaf_size_ < 1 ? 1 : leaf_size_; }
 
-void BVH::Build(vector<Object *> &objs) {
 
-		
-			BVHNode *root = new BVHNode();
+void BVH::setParallelBuild(bool parallel) { this->parallel_build = parallel; }
 
-			Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-			AABB world_bbox = AABB(min, max);
 
-			for (Object* obj : objs) {
-				AABB bbox = obj->GetBoundingBox();
-				world_bbox.extend(bbox);
-				objects.push_back(obj);
-			}
-			world_bbox.min.x -= EPSILON; world_bbox.min.y -= EPSILON; world_bbox.min.z -= EPSILON;
-			world_bbox.max.x += EPSILON; world_bbox.max.y += EPSILON; world_bbox.max.z += EPSILON;
-			root->setAABB(world_bbox);
-			nodes.push_back(root);
-			build_recursive(0, objects.size(), root); // -> root node takes all the 
+void BVH::setBuilder(int builder_) { this->builder = builder_; }
+
+
+// init_build: the start shared by the builders. Keeps the unbounded objects apart and fills
+// build_prims with the others, their bounds and centroids, which are computed once here, in
+// parallel, and only read by the builders afterwards. Returns false if there is nothing left to
+// build: no bounded objects, or a tree of the same geometry in the cache. Otherwise world_bbox
+// holds the bounds of the scene, key the cache key of cache_builder, and nodes the root to build.
+bool BVH::init_build(vector<Object *> &all_objs, int cache_builder, AABB& world_bbox, uint64_t& key) {
+	vector<Object *> objs;
+
+	split_unbounded(all_objs, objs);
+	if (objs.empty()) {  // planes only
+		clear_tree();
+		return false;
+	}
+
+	int n_objs = objs.size();
+	int n_chunks = parallel_build ? num_threads() : 1;
+
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	world_bbox = AABB(min, max);
+	vector<AABB> chunk_bbox(n_chunks, world_bbox);
+
+	build_prims.clear();
+	build_prims.resize(n_objs);
+
+	parallel_for(0, n_objs, n_chunks, [&](int chunk, int first, int last) {
+		for (int i = first; i < last; i++) {
+			BuildPrim& prim = build_prims[i];
+			prim.obj = objs[i];
+			prim.index = i;
+			prim.bbox = objs[i]->GetBoundingBox();
+			prim.centroid = prim.bbox.centroid();
+			chunk_bbox[chunk].extend(prim.bbox);
 		}
+	});
 
-// build_recursive: This is a helper function for the tree-building process.
-// It recursively subdivides the space and assigns objects to nodes based on, 
-// Surface Area Heuristic(SAH) or a simple axis-aligned split.
-void BVH::build_recursive(int left_index, int right_index, BVHNode* node) {
-	//PUT YOUR CODE HERE
+	for (AABB& bbox : chunk_bbox)
+		world_bbox.extend(bbox);
+
+	world_bbox.min.x -= EPSILON; world_bbox.min.y -= EPSILON; world_bbox.min.z -= EPSILON;
+	world_bbox.max.x += EPSILON; world_bbox.max.y += EPSILON; world_bbox.max.z += EPSILON;
+
+	key = cache_key(cache_builder);
+	if (load_cache(key, objs)) return false;
+
+	BVHNode root;
+	root.setAABB(world_bbox);
 
-	if ((right_index - left_index) <= 2) node->makeLeaf(left_index, right_index - left_index); // Check index
+	// a binary tree with leaves of at least one object has less than 2n nodes
+	nodes.clear();
+	nodes.reserve(2 * build_prims.size() + 2);
+	nodes.push_back(root);
+	nodes.push_back(BVHNode());  // unused: from here on sibling pairs start at even indices and share a cache line
 
+	return true;
+}
+
+// finish_build: collapses the binary tree into the wide tree that is traversed, saves it 
+// to the cache under key and releases the build data
+void BVH::finish_build(uint64_t key) {
+	wide_nodes.clear();
+	wide_nodes.reserve(nodes.size() / 2 + 1);
+	wide_nodes.push_back(WideNode());
+	collapse(0, 0);
+
+	cache_file.Close();
+	wide_root = wide_nodes.data();
+	n_wide_nodes = wide_nodes.size();
+	from_cache = false;
+
+	nodes.clear();
+	nodes.shrink_to_fit();
+
+	// leaves index the objects vector, which follows the final order of the build primitives
+	objects.clear();
+	objects.reserve(build_prims.size());
+	for (BuildPrim& prim : build_prims)
+		objects.push_back(prim.obj);
+
+	if (!store_primitives(objects)) clear_tree();  // too many primitives: the tree is left empty
 	else {
-		int split_index;
+		group_leaves();
+		if (!cache_dir.empty()) save_cache(key);
+	}
 
-		if (this -> SAH_splits < 3) {
-			split_index = this->SAH(left_index, right_index, node);
-			this -> SAH_splits++;
-		}
+	build_prims.clear();
+	build_prims.shrink_to_fit();
+}
+
+// group_leaves: lets every leaf test its runs of triangles or spheres PRIM_GROUP_SIZE at a time. The leaves
+// are disjoint ranges of the objects, so no group spans two of them.
+void BVH::group_leaves(void) {
+	for (size_t n = 0; n < n_wide_nodes; n++) {
+		const WideNode& node = wide_root[n];
+
+		for (int i = 0; i < BVH_WIDTH; i++)
+			if (node.n_objs[i] > 0) prims.groupPrimitives(&refs[node.child[i]], node.n_objs[i]);
+	}
+}
+
+// clear_tree: the tree of no objects, which is never traversed
+void BVH::clear_tree(void) {
+	cache_file.Close();
+	wide_nodes.clear();
+	wide_root = NULL;
+	n_wide_nodes = 0;
+	from_cache = false;
+	objects.clear();
+	store_primitives(objects);
+}
+
+void BVH::Build(vector<Object *> &objs) {
+	if (builder == BVH_BUILDER_LINEAR) BuildLinear(objs);
+	else if (builder == BVH_BUILDER_SPATIAL) BuildSpatial(objs);
+	else BuildSAH(objs);
+}
+
+void BVH::BuildSAH(vector<Object *> &all_objs) {
+	AABB world_bbox;
+	uint64_t key;
+
+	if (!init_build(all_objs, BVH_BUILDER_SAH, world_bbox, key)) return;
 
-		else split_index = this->find_split(left_index, right_index, node);
+	// fork subtree builds over the first levels only, enough to give every core some subtrees
+	fork_depth = 0;
+	if (parallel_build)
+		while ((1 << fork_depth) < 4 * num_threads()) fork_depth++;
+
+	build_recursive(0, build_prims.size(), 0, 0, nodes); // -> root node takes all the objects
+
+	finish_build(key);
+}
+
+// build_recursive: This is a helper function for the tree-building process.
+// It recursively subdivides the objects: ranges of at most leaf_size objects become 
+// leaves, larger ones are split by the binned Surface Area Heuristic (SAH).
+// Below BVH_MAX_SAH_DEPTH the objects are split at their median instead, which 
+// bounds the depth of the tree and so the size of the traversal stack.
+// The children of out[node_index] and all their descendants are appended to out.
+// Over the first fork_depth levels the two subtrees of large nodes are built at the 
+// same time in arrays of their own and then appended one after the other, which 
+// gives exactly the node order of the serial build.
+void BVH::build_recursive(int left_index, int right_index, unsigned int node_index, int depth, NodeArray& out) {
+
+	if ((right_index - left_index) <= leaf_size) out[node_index].makeLeaf(left_index, right_index - left_index);
+
+	else {
+		int split_index = -1;
+		AABB bbox = out[node_index].getAABB();
+
+		if (depth < BVH_MAX_SAH_DEPTH)
+			split_index = this->SAH(left_index, right_index);
+
+		if (split_index <= left_index || split_index >= right_index)
+			split_index = this->median_split(left_index, right_index, bbox);
 
 		AABB left_bbox = this->build_bbox(left_index, split_index);
 		AABB right_bbox = this->build_bbox(split_index, right_index);
 
-		BVHNode* left_node = new BVHNode();
-		BVHNode* right_node = new BVHNode();
+		unsigned int left_node = out.size();
+		unsigned int right_node = left_node + 1;
 
-		node->makeNode(this->nodes.size());
+		out[node_index].makeNode(left_node);
 
-		left_node->setAABB(left_bbox);
-		right_node->setAABB(right_bbox);
+		out.push_back(BVHNode());
+		out.push_back(BVHNode());
+		out[left_node].setAABB(left_bbox);
+		out[right_node].setAABB(right_bbox);
 
-		nodes.push_back(left_node);
-		nodes.push_back(right_node);
+		if (depth < fork_depth && right_index - left_index >= BVH_PARALLEL_SUBTREE) {
+			// each subtree array starts with a copy of its root
+			NodeArray left_tree(1, out[left_node]), right_tree(1, out[right_node]);
 
-		this->build_recursive(left_index, split_index, left_node);
-		this->build_recursive(split_index, right_index, right_node);
+			thread left_builder([&]() { this->build_recursive(left_index, split_index, 0, depth + 1, left_tree); });
+			this->build_recursive(split_index, right_index, 0, depth + 1, right_tree);
+			left_builder.join();
+
+			append_subtree(out, left_node, left_tree);
+			append_subtree(out, right_node, right_tree);
+		}
+		else {
+			this->build_recursive(left_index, split_index, left_node, depth + 1, out);
+			this->build_recursive(split_index, right_index, right_node, depth + 1, out);
+		}
 
 		//right_index, left_index and split_index refer to the indices in the objects vector
 		// do not confuse with left_nodde_index and right_node_index which refer to indices in the nodes vector. 
@@ -86,93 +227,154 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode* node) {
 	}
 }
 
-// SAH: Surface Area Heuristic. This method calculates the cost of splitting a bounding 
-// box at different positions and chooses the split position that minimizes the cost. 
-// SAH aims to balance the number of objects in each child node and minimize the surface 
-// area of the resulting bounding boxes.
-int BVH::SAH(int left_index, int right_index, BVHNode* node) {
-	float cost_traversal = 1.0f;
-	float cost_intersection = 10.0f;
-	float total_cost = 0.0f;
-	float min_cost = FLT_MAX;
-	float split_index;
-	float cost_parent = (right_index - left_index) * cost_intersection;
-	float sa_parent = node->getAABB().surface_area();
-	float sa_left, sa_rigth;
-
-	BVH::Comparator comparator;
+// append_subtree: copies a subtree built on its own array (root at 0, descendants from 1) 
+// into out, the root over out[node_index] and the descendants at the end, relocating 
+// the child indices of the interior nodes.
+void BVH::append_subtree(NodeArray& out, unsigned int node_index, NodeArray& subtree) {
+	unsigned int offset = out.size() - 1;  // subtree[i] ends up at out[offset + i] for i >= 1
 
-	for (int n = 0; n < 3; n++) {
-		int k = 1;
-		comparator.dimension = 0;
-		std::sort(this->objects.begin() + left_index, this->objects.begin() + right_index, comparator);
+	for (unsigned int i = 0; i < subtree.size(); i++) {
+		BVHNode node = subtree[i];
 
-		vector<float> right_surface_areas;
-		Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX);
-		Vector max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		if (!node.isLeaf()) node.makeNode(node.getIndex() + offset);
 
-		AABB right_bbox = AABB(min, max);
-		AABB left_bbox = AABB(min, max);
+		if (i == 0) out[node_index] = node;
+		else out.push_back(node);
+	}
+}
 
-		for (int i = right_index - 1; i >= left_index + 1; i--) {
-			Object* obj = this->objects[i];
-			right_bbox.extend(obj->GetBoundingBox());
-			right_surface_areas.push_back(right_bbox.surface_area());
+// SAH: Surface Area Heuristic. The centroids of the range are projected into 
+// BVH_SAH_BINS equal bins along each of the three axes; one sweep over the bins 
+// gives the cost SA(left) * N(left) + SA(right) * N(right) of every plane between 
+// two bins, so the whole search is O(n) instead of a sort per candidate axis.
+// The objects are partitioned by the cheapest plane, and the first index of the 
+// right side is returned (-1 if the centroids cannot be separated).
+// Ranges of at least BVH_PARALLEL_BINNING objects are binned by all cores, each 
+// filling its own bins that are then merged; box unions and counts do not depend 
+// on the merge order, so the result is the same as binning on one thread.
+int BVH::SAH(int left_index, int right_index) {
+	struct Bin {
+		AABB bbox;
+		int count;
+	};
+
+	int n_chunks = (parallel_build && right_index - left_index >= BVH_PARALLEL_BINNING) ? num_threads() : 1;
+
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	AABB centroid_bbox = AABB(min, max);
+	vector<AABB> chunk_bbox(n_chunks, centroid_bbox);
+
+	parallel_for(left_index, right_index, n_chunks, [&](int chunk, int first, int last) {
+		for (int i = first; i < last; i++) {
+			Vector& c = build_prims[i].centroid;
+			chunk_bbox[chunk].extend(AABB(c, c));
 		}
+	});
+
+	for (AABB& bbox : chunk_bbox)
+		centroid_bbox.extend(bbox);
+
+	float c_min[3], scale[3];
 
-		for (int i = left_index; i < right_index; i++, k++) {
-			Object* obj = this->objects[i];
-			left_bbox.extend(obj->GetBoundingBox());
+	for (int axis = 0; axis < 3; axis++) {
+		c_min[axis] = centroid_bbox.min.getAxisValue(axis);
+		float extent = centroid_bbox.max.getAxisValue(axis) - c_min[axis];
+		scale[axis] = extent > 0.0f ? BVH_SAH_BINS / extent : 0.0f;  // extent 0: all centroids on one plane, nothing to split
+	}
+
+	// bins of the three axes, filled in one pass over the objects
+	Bin empty_bin = { AABB(min, max), 0 };
+	vector<Bin> chunk_bins(n_chunks * 3 * BVH_SAH_BINS, empty_bin);
 
-			sa_left = left_bbox.surface_area();
-			sa_rigth = right_surface_areas[right_index - 2 - i];
+	parallel_for(left_index, right_index, n_chunks, [&](int chunk, int first, int last) {
+		Bin* bins = &chunk_bins[chunk * 3 * BVH_SAH_BINS];
 
-			total_cost = cost_traversal + (sa_left / sa_parent) * k * cost_intersection + (sa_rigth / sa_parent) * (right_index - (left_index + k)) * cost_intersection;
+		for (int i = first; i < last; i++) {
+			for (int axis = 0; axis < 3; axis++) {
+				int b = (int)((build_prims[i].centroid.getAxisValue(axis) - c_min[axis]) * scale[axis]);
+				if (b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
 
-			if (total_cost < cost_parent) {
-				if (total_cost < min_cost) {
-					min_cost = total_cost;
-					split_index = left_index + k;
-				}
-				break;
+				bins[axis * BVH_SAH_BINS + b].count++;
+				bins[axis * BVH_SAH_BINS + b].bbox.extend(build_prims[i].bbox);
 			}
 		}
+	});
+
+	for (int chunk = 1; chunk < n_chunks; chunk++) {
+		for (int b = 0; b < 3 * BVH_SAH_BINS; b++) {
+			chunk_bins[b].count += chunk_bins[chunk * 3 * BVH_SAH_BINS + b].count;
+			chunk_bins[b].bbox.extend(chunk_bins[chunk * 3 * BVH_SAH_BINS + b].bbox);
+		}
 	}
 
-	if (split_index >= right_index) return (right_index + left_index) / 2;
+	float min_cost = FLT_MAX;
+	int best_axis = -1, best_plane = 0;
 
-	return split_index;
-}
+	for (int axis = 0; axis < 3; axis++) {
+		if (scale[axis] == 0.0f) continue;
 
-// find_split: This method finds a split position based on the largest dimension 
-// of the bounding box. It sorts objects along that dimension and chooses the 
-// midpoint as the split position.
-int BVH::find_split(int left_index, int right_index, BVHNode* node) {
+		Bin* bins = &chunk_bins[axis * BVH_SAH_BINS];
 
-	AABB bbox = node->getAABB();
+		// right to left sweep: cost of the right side of each plane
+		float right_cost[BVH_SAH_BINS];
+		AABB right_bbox = AABB(min, max);
+		int right_count = 0;
 
-	int largest_coor = (bbox.max - bbox.min).largest_coordinate();
-	float largest_dist = (bbox.max - bbox.min).getAxisValue(largest_coor);
+		for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+			right_bbox.extend(bins[b].bbox);
+			right_count += bins[b].count;
+			right_cost[b] = right_count ? right_bbox.surface_area() * right_count : 0.0f;
+		}
 
-	BVH::Comparator comparator;
-	comparator.dimension = largest_coor;
-	std::sort(this->objects.begin() + left_index, this->objects.begin() + right_index, comparator);
+		// left to right sweep: plane p separates bins [0, p[ from [p, BVH_SAH_BINS[
+		AABB left_bbox = AABB(min, max);
+		int left_count = 0;
 
-	int split_index = left_index;
+		for (int p = 1; p < BVH_SAH_BINS; p++) {
+			left_bbox.extend(bins[p - 1].bbox);
+			left_count += bins[p - 1].count;
 
-	if (this->objects[left_index]->getCentroid().getAxisValue(largest_coor) > largest_dist / 2 || 
-		this->objects[right_index - 1]->getCentroid().getAxisValue(largest_coor) < largest_dist / 2) {
-		return (right_index + left_index) / 2;
-	}
+			if (left_count == 0 || left_count == right_index - left_index) continue;
 
-	while (split_index < right_index &&
-		this->objects[split_index]->getCentroid().getAxisValue(largest_coor) < largest_dist / 2) {
+			float cost = left_bbox.surface_area() * left_count + right_cost[p];
 
-		split_index++;
+			if (cost < min_cost) {
+				min_cost = cost;
+				best_axis = axis;
+				best_plane = p;
+			}
+		}
 	}
-	
-	if (split_index < right_index && split_index > left_index) return split_index;
 
+	if (best_axis == -1) return -1;
+
+	float axis_min = c_min[best_axis];
+	float axis_scale = scale[best_axis];
+
+	BuildPrim* middle = std::partition(build_prims.data() + left_index, build_prims.data() + right_index,
+		[best_axis, best_plane, axis_min, axis_scale](BuildPrim& prim) {
+			int b = (int)((prim.centroid.getAxisValue(best_axis) - axis_min) * axis_scale);
+			if (b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
+			return b < best_plane;
+		});
+
+	return (int)(middle - build_prims.data());
+}
+
+// median_split: splits the range in two halves at the median centroid along the 
+// largest dimension of the node's bounding box. Used where the SAH cannot separate 
+// the objects and below BVH_MAX_SAH_DEPTH.
+int BVH::median_split(int left_index, int right_index, AABB& bbox) {
+
+	int largest_coor = (bbox.max - bbox.min).largest_coordinate();
+	int split_index = (left_index + right_index) / 2;
+
+	std::nth_element(build_prims.data() + left_index, build_prims.data() + split_index, build_prims.data() + right_index,
+		[largest_coor](BuildPrim& a, BuildPrim& b) {
+			return a.centroid.getAxisValue(largest_coor) < b.centroid.getAxisValue(largest_coor);
+		});
+
+	return split_index;
 }
 
 AABB BVH::build_bbox(int left_index, int right_index) {
@@ -180,169 +382,219 @@ AABB BVH::build_bbox(int left_index, int right_index) {
 	Vector max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 	AABB bbox = AABB(min, max);
 
-	for (int i = left_index; i < right_index; i++) {
-		AABB obj_bbox = this->objects[i]->GetBoundingBox();
-		bbox.extend(obj_bbox);
-	}
+	int n_chunks = (parallel_build && right_index - left_index >= BVH_PARALLEL_BINNING) ? num_threads() : 1;
+	vector<AABB> chunk_bbox(n_chunks, bbox);
+
+	parallel_for(left_index, right_index, n_chunks, [&](int chunk, int first, int last) {
+		for (int i = first; i < last; i++)
+			chunk_bbox[chunk].extend(build_prims[i].bbox);
+	});
+
+	for (AABB& b : chunk_bbox)
+		bbox.extend(b);
 
 	return bbox;
 }
 
-// Traverse: This method traverses the BVH tree to find intersections between 
-// a ray and objects in the scene. It starts from the root node and recursively 
-// descends the tree, checking for intersections with bounding boxes and individual 
-// objects. If an intersection is found, it updates the closest intersection distance 
-// and the intersected object.
-bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
-	float tmp;
-	float tmin = FLT_MAX;  //contains the closest primitive intersection
-	bool hit = false;
-
-	BVHNode* current_node = nodes[0];
-	AABB current_bbox = current_node->getAABB();
-
-	if (!current_bbox.intercepts(ray, tmp)) return false;
-
-	while (true) {
-		if (!current_node->isLeaf()) {
-			BVHNode* left_child = this->nodes[current_node->getIndex()];
-			BVHNode* right_child = this->nodes[current_node->getIndex() + 1];
-
-			float tmp_1 = 0;
-			float tmp_2 = 0;
-
-			bool left_hit = left_child->getAABB().intercepts(ray, tmp_1);
-			bool right_hit = right_child->getAABB().intercepts(ray, tmp_2);
-
-			if (left_hit && right_hit) {
-				StackItem stack_item(left_child, tmp_1);
-				current_node = right_child;
-
-				if (tmp_2 > tmp_1) {
-					stack_item.ptr = right_child;
-					stack_item.t = tmp_2;
-					current_node = left_child;
-				}
-
-				this->hit_stack.push(stack_item);
-				continue;
-			}
+// collapse: fills the wide node wide_index with the descendants of the binary node 
+// node_index. Starting from its two children, the interior child with the largest 
+// surface area is replaced by its own two children until BVH_WIDTH slots are used, 
+// then every interior child left gets a wide node of its own.
+void BVH::collapse(unsigned int node_index, unsigned int wide_index) {
+	unsigned int children[BVH_WIDTH];
+	int n_children = 0;
 
-			else if (left_hit || right_hit) {
-				current_node = left_hit ? left_child : right_child;
-				continue;
+	if (nodes[node_index].isLeaf()) 
+		children[n_children++] = node_index;  // the whole tree is a single leaf
+	else {
+		children[n_children++] = nodes[node_index].getIndex();
+		children[n_children++] = nodes[node_index].getIndex() + 1;
+	}
+
+	while (n_children < BVH_WIDTH) {
+		int largest = -1;
+		float largest_area = -1.0f;
+
+		for (int i = 0; i < n_children; i++) {
+			if (!nodes[children[i]].isLeaf() && nodes[children[i]].getArea() > largest_area) {
+				largest_area = nodes[children[i]].getArea();
+				largest = i;
 			}
 		}
 
+		if (largest == -1) break;  // only leaves left
+
+		unsigned int opened = children[largest];
+		children[largest] = nodes[opened].getIndex();
+		children[n_children++] = nodes[opened].getIndex() + 1;
+	}
+
+	unsigned int wide_children[BVH_WIDTH];
+
+	for (int i = 0; i < BVH_WIDTH; i++) {
+		WideNode& wide = wide_nodes[wide_index];
+
+		if (i >= n_children) {
+			for (int k = 0; k < 6; k++) wide.bounds[k][i] = INFINITY;
+			wide.child[i] = 0;
+			wide.n_objs[i] = 0;
+			wide_children[i] = 0;
+			continue;
+		}
+
+		BVHNode& node = nodes[children[i]];
+		AABB bbox = node.getAABB();
+
+		wide.bounds[0][i] = bbox.min.x; wide.bounds[1][i] = bbox.min.y; wide.bounds[2][i] = bbox.min.z;
+		wide.bounds[3][i] = bbox.max.x; wide.bounds[4][i] = bbox.max.y; wide.bounds[5][i] = bbox.max.z;
+
+		if (node.isLeaf()) {
+			wide.child[i] = node.getIndex();
+			wide.n_objs[i] = node.getNObjs();
+			wide_children[i] = 0;
+		}
 		else {
-			for (int i = current_node->getIndex(); i < current_node->getIndex() + current_node->getNObjs(); i++) {
-				Object* obj = this->objects[i];
-				float tmp;
-
-				if (obj->GetBoundingBox().intercepts(ray, tmp)) {
-					if (obj->intercepts(ray, tmp) && tmp < tmin) {
-						tmin = tmp;
-						*hit_obj = obj;
-					}
-				}
-			}
+			wide_children[i] = wide_nodes.size();
+			wide.child[i] = wide_children[i];
+			wide.n_objs[i] = 0;
+			wide_nodes.push_back(WideNode());  // the reserve in Build keeps the reference valid
+		}
+	}
+
+	for (int i = 0; i < n_children; i++)
+		if (wide_children[i] != 0) collapse(children[i], wide_children[i]);
+}
+
+// intercepts_children: slab test of the ray against the BVH_WIDTH children boxes 
+// of a wide node at once. Returns a bit mask of the children hit before t_max and 
+// their entry distances in t_entry (negative when the ray starts inside a box).
+inline int BVH::intercepts_children(const WideNode& node, const __m128* origin, const __m128* inv_dir, float t_max, float* t_entry) {
+	__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0]), origin[0]), inv_dir[0]);
+	__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1]), origin[1]), inv_dir[1]);
+	__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[2]), origin[2]), inv_dir[2]);
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[3]), origin[0]), inv_dir[0]);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[4]), origin[1]), inv_dir[1]);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[5]), origin[2]), inv_dir[2]);
+
+	//largest entering t value
+	__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+	//smallest exiting t value
+	__m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1), _mm_cmpgt_ps(t1, _mm_setzero_ps()));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(t0, _mm_set1_ps(t_max)));
+
+	_mm_storeu_ps(t_entry, t0);
+	return _mm_movemask_ps(hit);
+}
+
+// Traverse: This method traverses the BVH tree to find intersections between 
+// a ray and objects in the scene. It starts from the root node and descends 
+// the tree, testing the children boxes of each wide node at once and visiting 
+// the hit children from the nearest to the farthest. Nodes that start beyond 
+// the closest intersection found so far are skipped.
+// The traversal stack is a fixed-size array on the caller's stack frame and the BVH 
+// is never written, so any number of threads can traverse the same BVH without locks.
+bool BVH::Traverse(Ray& ray, HitRecord& hit) {
+	float t_max = hit.t;  // hit.t: the closest primitive intersection
+	StackItem hit_stack[BVH_WIDE_STACK_SIZE];
+	int stack_size = 0;
+
+	intercepts_unbounded(ray, hit);  // a plane in front of the objects prunes them all
+
+	if (!objects.empty()) hit_stack[stack_size++] = StackItem(0, 0, -FLT_MAX);
+
+	__m128 origin[3] = { _mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z) };
+	__m128 inv_dir[3] = { _mm_set1_ps(1.0f / ray.direction.x), _mm_set1_ps(1.0f / ray.direction.y), _mm_set1_ps(1.0f / ray.direction.z) };
+
+	while (stack_size > 0) {
+		StackItem item = hit_stack[--stack_size];
+
+		if (item.t >= hit.t) continue;  // found a closer hit since the node was pushed
+
+		if (item.n_objs > 0) {
+			prims.intercepts(&refs[item.index], item.n_objs, ray, hit);
+			continue;
 		}
 
-		while (true) {
-			if (this->hit_stack.empty()) {
-				if (tmin == FLT_MAX) {
-					return false;
-				}
+		const WideNode& node = wide_root[item.index];
+		float t_entry[BVH_WIDTH];
+		int mask = intercepts_children(node, origin, inv_dir, hit.t, t_entry);
 
-				hit_point = ray.origin + ray.direction * tmin;
-				return true;
-			}
+		// sort the hit children from the farthest to the nearest, so the nearest is popped first
+		int order[BVH_WIDTH];
+		int n_hits = 0;
 
-			StackItem stack_item = this->hit_stack.top();
+		for (int i = 0; i < BVH_WIDTH; i++) {
+			if (!(mask & (1 << i))) continue;
 
-			if (stack_item.t < tmin) {
-				current_node = stack_item.ptr;
-				this->hit_stack.pop();
-				break;
+			int k = n_hits++;
+			while (k > 0 && t_entry[order[k - 1]] < t_entry[i]) {
+				order[k] = order[k - 1];
+				k--;
 			}
-
-			this->hit_stack.pop();
+			order[k] = i;
 		}
+
+		assert(stack_size + n_hits <= BVH_WIDE_STACK_SIZE);  // the builders keep trees shallower than BVH_STACK_SIZE
+		for (int k = 0; k < n_hits; k++)
+			hit_stack[stack_size++] = StackItem(node.child[order[k]], node.n_objs[order[k]], t_entry[order[k]]);
 	}
 
-	hit_point = ray.origin + ray.direction * tmin;
-	return true;
+	return hit.t < t_max;
 }
 
 //Traverse(with shadow ray): Similar to the regular traversal method, 
 // but optimized for shadow rays. It checks for intersections but 
 // doesn't calculate the exact intersection point or object, because 
 // there is no need for that, as it's used for determining shadows.
-bool BVH::Traverse(Ray& ray) {  //shadow ray with length
-			float temp;
-			double length = ray.direction.length(); //distance between light and intersection point
-			ray.direction.normalize();
-
-			BVHNode* current_node = nodes[0];
-			AABB current_bbox = current_node->getAABB();
-
-			if (!current_bbox.intercepts(ray, temp)) return false;
-
-			while (true) {
-				if (!current_node->isLeaf()) {
-					BVHNode* left_child = this->nodes[current_node->getIndex()];
-					BVHNode* right_child = this->nodes[current_node->getIndex() + 1];
-
-					float temp1 = 0;
-					float temp2 = 0;
-
-					bool left_hit = left_child->getAABB().intercepts(ray, temp1);
-					bool right_hit = right_child->getAABB().intercepts(ray, temp2);
-
-					if (left_hit && right_hit) {
-						StackItem stack_item(left_child, temp1);
-						current_node = right_child;
-
-						if (temp2 > temp1) {
-							stack_item.ptr = right_child;
-							stack_item.t = temp2;
-							current_node = left_child;
-						}
-
-						this->hit_stack.push(stack_item);
-						continue;
-					}
-
-					else if (left_hit || right_hit) {
-						current_node = left_hit ? left_child : right_child;
-						continue;
-					}
-				}
-
-				else {
-					for (int i = current_node->getIndex(); i < current_node->getIndex() + current_node->getNObjs(); i++) {
-						Object* obj = this->objects[i];
-						float temp;
-
-						if (obj->GetBoundingBox().intercepts(ray, temp)) {
-							if (obj->intercepts(ray, temp)) {
-								return true;
-							}
-						}
-					}
-				}
-
-				while (true) {
-					if (this->hit_stack.empty()) {
-						return false;
-					}
-
-					StackItem stack_item = this->hit_stack.top();
-					current_node = stack_item.ptr;
-					this->hit_stack.pop();
-					break;
-				}
-			}
+// Only hits closer than the light (length) block it,
+// and the children are visited in storage order since any hit ends the search.
+bool BVH::Traverse(const Ray& shadow_ray, float length) {
+	Ray ray = shadow_ray;  // the object tests take a Ray&
+
+	StackItem hit_stack[BVH_WIDE_STACK_SIZE];
+	int stack_size = 0;
+
+	if (intercepts_unbounded(ray, length)) return true;
+	if (objects.empty()) return false;
+
+	__m128 origin[3] = { _mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z) };
+	__m128 inv_dir[3] = { _mm_set1_ps(1.0f / ray.direction.x), _mm_set1_ps(1.0f / ray.direction.y), _mm_set1_ps(1.0f / ray.direction.z) };
+
+	hit_stack[stack_size++] = StackItem(0, 0, 0.0f);
+
+	while (stack_size > 0) {
+		StackItem item = hit_stack[--stack_size];
+
+		if (item.n_objs > 0) {
+			if (prims.occluded(&refs[item.index], item.n_objs, ray, length)) return true;
+			continue;
+		}
+
+		const WideNode& node = wide_root[item.index];
+		float t_entry[BVH_WIDTH];
+		int mask = intercepts_children(node, origin, inv_dir, length, t_entry);
+
+		assert(stack_size + BVH_WIDTH <= BVH_WIDE_STACK_SIZE);
+		for (int i = 0; i < BVH_WIDTH; i++)
+			if (mask & (1 << i)) hit_stack[stack_size++] = StackItem(node.child[i], node.n_objs[i], t_entry[i]);
+	}
+
+	return false;
+}
+
+AcceleratorStats BVH::getStats() {
+	AcceleratorStats stats;
+
+	stats.nodes = n_wide_nodes;
+	stats.leaves = 0;
+	stats.references = objects.size();
+	stats.memory = n_wide_nodes * sizeof(WideNode) + objects.size() * sizeof(Object*) + refs.size() * sizeof(PrimRef) + prims.getMemory();
+
+	for (size_t i = 0; i < n_wide_nodes; i++)
+		for (int k = 0; k < BVH_WIDTH; k++)
+			if (wide_root[i].n_objs[k] > 0) stats.leaves++;
 
-			return(false);
+	return stats;
 }
@@ -0,0 +1,144 @@
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include "rayAccelerator.h"
+
+using namespace std;
+
+// On-disk cache of built BVHs. A built tree depends on the objects, in their order, and on the
+// builder settings, so these are hashed into the key that names the cache file. The object and
+// linear builders only read the bounding boxes, but the spatial splits clip the triangles
+// themselves, so two scenes with the same boxes (a quad with its diagonal flipped) can give
+// different trees: the key hashes the shapes too (Object::getGeometry), the points of the
+// triangles and the centers and radii of the spheres. Changing the camera, lights or materials
+// keeps the key; moving or reshaping any object changes it.
+// File layout: CacheHeader, the wide nodes, and for every leaf slot the index of its object in
+// the objects given to Build (objects split by BuildSpatial appear more than once). The header is 64 bytes and the mapping starts at a page boundary,
+// so the nodes are traversed in place from the mapped file, with the alignment of wide_nodes.
+
+struct CacheHeader {
+	char magic[8];
+	uint64_t key;
+	uint32_t n_wide_nodes;
+	uint32_t n_objects;
+	char unused[40];
+};
+static_assert(sizeof(CacheHeader) == 64, "CacheHeader must keep the nodes cache-line aligned");
+
+static const char cache_magic[8] = { 'P', '3', 'D', 'B', 'V', 'H', '\0', '\0' };
+
+// ---------------------------------------------------- FNV-1a
+static inline void hash_bytes(uint64_t& hash, const void* bytes, size_t size) {
+	const unsigned char* p = (const unsigned char*)bytes;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+void BVH::setCacheDirectory(const string& dir) { this->cache_dir = dir; }
+
+// cache_key: hash of the builder settings and of the bounds and primitive data of build_prims
+// (in the given order)
+uint64_t BVH::cache_key(int builder) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	if (cache_dir.empty()) return hash;
+
+	int settings[] = { BVH_CACHE_VERSION, builder, leaf_size, BVH_WIDTH, BVH_SAH_BINS, BVH_MAX_SAH_DEPTH,
+		BVH_LBVH_WIDE_CODES, BVH_TREELET_LEAVES, BVH_SBVH_BINS, (int)(spatial_budget * 1000.0f), (int)sizeof(WideNode), (int)build_prims.size() };
+	hash_bytes(hash, settings, sizeof(settings));
+
+	float geometry[9];
+
+	for (BuildPrim& prim : build_prims) {
+		float bounds[6] = { prim.bbox.min.x, prim.bbox.min.y, prim.bbox.min.z, prim.bbox.max.x, prim.bbox.max.y, prim.bbox.max.z };
+		hash_bytes(hash, bounds, sizeof(bounds));
+		hash_bytes(hash, geometry, prim.obj->getGeometry(geometry) * sizeof(float));
+	}
+
+	return hash;
+}
+
+string BVH::cache_path(uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "bvh_%016llx.cache", (unsigned long long)key);
+	return cache_dir + name;
+}
+
+// load_cache: maps the cache file of key and, if it is valid for objs, makes it the tree
+// to traverse and drops the build data. Returns false if the tree has to be built.
+bool BVH::load_cache(uint64_t key, vector<Object*>& objs) {
+	if (cache_dir.empty()) return false;
+	if (!cache_file.Open(cache_path(key))) return false;
+
+	const char* data = cache_file.getData();
+	size_t size = cache_file.getSize();
+	const CacheHeader* header = (const CacheHeader*)data;
+
+	bool valid = size >= sizeof(CacheHeader) && memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0 &&
+		header->key == key && header->n_wide_nodes > 0 &&
+		size == sizeof(CacheHeader) + (size_t)header->n_wide_nodes * sizeof(WideNode) + (size_t)header->n_objects * sizeof(uint32_t);
+
+	if (valid) {
+		const uint32_t* order = (const uint32_t*)(data + sizeof(CacheHeader) + (size_t)header->n_wide_nodes * sizeof(WideNode));
+
+		objects.clear();
+		objects.reserve(header->n_objects);
+		for (uint32_t i = 0; i < header->n_objects && valid; i++) {
+			if (order[i] >= objs.size()) valid = false;
+			else objects.push_back(objs[order[i]]);
+		}
+	}
+
+	if (!valid) {
+		cache_file.Close();
+		objects.clear();
+		return false;
+	}
+
+	wide_root = (const WideNode*)(data + sizeof(CacheHeader));
+	n_wide_nodes = header->n_wide_nodes;
+	from_cache = true;
+
+	if (!store_primitives(objects)) clear_tree();  // too many primitives: a build would fail the same way
+	else group_leaves();
+
+	wide_nodes.clear();
+	wide_nodes.shrink_to_fit();
+	nodes.clear();
+	nodes.shrink_to_fit();
+	build_prims.clear();
+	build_prims.shrink_to_fit();
+	return true;
+}
+
+// save_cache: writes the wide nodes and the object order of the finished build under key.
+// A cache that cannot be written only costs a rebuild next time.
+void BVH::save_cache(uint64_t key) {
+	string path = cache_path(key);
+	string tmp_path = path + ".tmp";
+	ofstream file(tmp_path.c_str(), ios::out | ios::binary | ios::trunc);
+
+	if (!file) return;
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.key = key;
+	header.n_wide_nodes = wide_nodes.size();
+	header.n_objects = build_prims.size();
+
+	vector<uint32_t> order(build_prims.size());
+	for (size_t i = 0; i < build_prims.size(); i++)
+		order[i] = build_prims[i].index;
+
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)wide_nodes.data(), wide_nodes.size() * sizeof(WideNode));
+	file.write((const char*)order.data(), order.size() * sizeof(uint32_t));
+	file.close();
+
+	// written aside and renamed, so an interrupted save never leaves a truncated cache behind
+	remove(path.c_str());
+	if (!file || rename(tmp_path.c_str(), path.c_str()) != 0) remove(tmp_path.c_str());
+}
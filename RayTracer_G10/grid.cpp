@@ -1,5 +1,7 @@
 #include "rayAccelerator.h"
 #include "macros.h"
+#include "parallel.h"
+#include <chrono>
 
 
 Grid::Grid(void) {}
@@ -27,77 +29,313 @@ Object* Grid::getObject(unsigned int index)
 }
 
 // ---------------------------------------------setup_cells
-void Grid::Build(vector<Object*>& objs) {
+void Grid::Build(vector<Object*>& scene_objs) {
+	vector<Object*> objs;
 
-	int xmin, xmax;
-	int ymin, ymax;
-	int zmin, zmax;
-	int index;  	// cell's array index
+	split_unbounded(scene_objs, objs);
 
+	objects.clear();
 
-	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	//insert scene objects in the Grid objects list
+	for (Object* obj : objs)
+		this->addObject(obj);
 
-	AABB grid_bbox = AABB(min, max);
+	if (!store_primitives(objects)) objects.clear();  // too many primitives: the grid is left empty
 
-	//build the Grid BB and //insert scene objects in the Grid objects list
-	for (Object* obj : objs) {
-		AABB o_bbox = obj->GetBoundingBox();
-		grid_bbox.extend(o_bbox);
-		this->addObject(obj);
+	if (objects.empty()) {  // planes only
+		cell_offsets.clear();
+		cell_prims.clear();
+		cell_sub.clear();
+		levels.clear();
+		return;
 	}
+
+	//build the Grid BB
+	AABB grid_bbox = store_bounds(objects);
+
 	//slightly enlarge the grid box just for case
 	grid_bbox.min.x -= EPSILON; grid_bbox.min.y -= EPSILON; grid_bbox.min.z -= EPSILON;
 	grid_bbox.max.x += EPSILON; grid_bbox.max.y += EPSILON; grid_bbox.max.z += EPSILON;
 
 	this->setAABB(grid_bbox);
-	
-		
+
+	vector<unsigned int> all_objs(objects.size());
+	for (unsigned int o = 0; o < objects.size(); o++) all_objs[o] = o;
+
+	GridLevel top;
+	top.bbox = bbox;
+	top.first_cell = 0;
+	top.depth = 0;
+	setup_level(top, all_objs, m);
+	nx = top.nx; ny = top.ny; nz = top.nz;
+
+	levels.clear();
+	levels.push_back(top);
+	cell_offsets.assign(1, 0);
+	cell_prims.clear();
+	cell_sub.clear();
+
+	// the levels are filled in the order they are created: the cells of every sub-grid 
+	// come after those of all the levels before it
+	fill_cells(0, all_objs);
+
+	for (unsigned int l = 0; l < levels.size(); l++) {
+		if (levels[l].depth >= GRID_MAX_DEPTH) continue;
+
+		unsigned int first_cell = levels[l].first_cell;
+		int level_cells = levels[l].nx * levels[l].ny * levels[l].nz;
+
+		for (int c = 0; c < level_cells; c++) {
+			unsigned int cell = first_cell + c;
+			unsigned int n_objs = cell_offsets[cell + 1] - cell_offsets[cell];
+			if (n_objs <= GRID_SUB_THRESHOLD) continue;
+
+			// the sub-grid spans exactly the cell
+			GridLevel& parent = levels[l];
+			int ix = c % parent.nx, iy = (c / parent.nx) % parent.ny, iz = c / (parent.nx * parent.ny);
+			Vector size = Vector((parent.bbox.max.x - parent.bbox.min.x) / parent.nx, (parent.bbox.max.y - parent.bbox.min.y) / parent.ny,
+				(parent.bbox.max.z - parent.bbox.min.z) / parent.nz);
+
+			GridLevel sub;
+			sub.bbox.min = Vector(parent.bbox.min.x + ix * size.x, parent.bbox.min.y + iy * size.y, parent.bbox.min.z + iz * size.z);
+			sub.bbox.max = Vector(sub.bbox.min.x + size.x, sub.bbox.min.y + size.y, sub.bbox.min.z + size.z);
+			sub.first_cell = cell_offsets.size() - 1;
+			sub.depth = parent.depth + 1;
+
+			// the cell keeps its own list too, which traversal falls back to if the ray grazes the sub-grid
+			vector<unsigned int> cell_objs(cell_prims.begin() + cell_offsets[cell], cell_prims.begin() + cell_offsets[cell + 1]);
+			setup_level(sub, cell_objs, 0.0f);
+
+			if (sub.nx * sub.ny * sub.nz == 1) continue;
+
+			cell_sub[cell] = levels.size();
+			levels.push_back(sub);
+			fill_cells(levels.size() - 1, cell_objs);
+		}
+	}
+
+	free_bounds();
+
+	printf("\nGRID: total cells = %d, total objects = %d, ResX = %d, ResY = %d, ResZ = %d, density = %.2f, sub-grids = %d, cells in sub-grids = %d, object references = %d\n\n", 
+		nx * ny * nz, this->getNumObjects(), nx, ny, nz, levels[0].density, (int)levels.size() - 1, (int)cell_sub.size() - nx * ny * nz, (int)cell_prims.size());
+}
+
+// setup_level: resolution of a level holding objs, about density cells per object along each axis.
+// With density 0 it is chosen by the cost model among GRID_DENSITIES.
+void Grid::setup_level(GridLevel& level, vector<unsigned int>& objs, float density) {
+	static const float densities[] = { GRID_DENSITIES };
+
+	if (density <= 0.0f) {
+		float min_cost = FLT_MAX;
+
+		for (float candidate : densities) {
+			level.density = candidate;
+			set_resolution(level, objs.size());
+
+			float cost = level_cost(level, objs);
+			if (cost < min_cost) {
+				min_cost = cost;
+				density = candidate;
+			}
+		}
+	}
+
+	level.density = density;
+	set_resolution(level, objs.size());
+}
+
+// set_resolution: number of cells of the level along each axis, proportional to its extent
+void Grid::set_resolution(GridLevel& level, int n_objs) {
 	// dimensions of the grid in the x, y, and z directions
-	double wx = bbox.max.x - bbox.min.x;
-	double wy = bbox.max.y - bbox.min.y;
-	double wz = bbox.max.z - bbox.min.z;
+	double wx = level.bbox.max.x - level.bbox.min.x;
+	double wy = level.bbox.max.y - level.bbox.min.y;
+	double wz = level.bbox.max.z - level.bbox.min.z;
 
 	// compute the number of grid cells in the x, y, and z directions
-	double s = pow(this->getNumObjects() / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
-	//double s = pow(100000 / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
-	nx = m * wx * s + 1;
-	ny = m * wy * s + 1;
-	nz = m * wz * s + 1;
-
-	int cellCount = nx * ny * nz;
-
-	// set up a array to hold the objects stored in each cell
-	std::vector<Object*> obj_cell;
-	for (int i = 0; i < cellCount; i++) 
-		cells.push_back(obj_cell);   //each cell has an array with zero elements
-		
-	// insert the objects into the cells
-	for (auto &obj : objects) {   //vector iterator
-
-		AABB obb = obj->GetBoundingBox();
-
-		// Compute indices of both cells that contain min and max coord of obj bbox
-		int ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymin = clamp((obb.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmin = clamp((obb.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
-		int ixmax = clamp((obb.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymax = clamp((obb.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmax = clamp((obb.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
-
-		// add the object to the cells
-		for (int iz = izmin; iz <= izmax; iz++) 					// cells in z direction
-			for (int iy = iymin; iy <= iymax; iy++)					// cells in y direction
-				for (int ix = ixmin; ix <= ixmax; ix++) 			// cells in x direction
-					cells[ix + nx * iy + nx * ny * iz].push_back(obj);
+	double s = pow(n_objs / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
+	level.nx = level.density * wx * s + 1;
+	level.ny = level.density * wy * s + 1;
+	level.nz = level.density * wz * s + 1;
+
+	// bound the memory of very flat or very dense levels
+	double cells = (double)level.nx * level.ny * level.nz, max_cells = GRID_MAX_CELLS_PER_OBJECT * (double)n_objs + 1.0;
+	if (cells > max_cells) {
+		double shrink = pow(max_cells / cells, 0.3333333);
+		level.nx = level.nx * shrink + 1;
+		level.ny = level.ny * shrink + 1;
+		level.nz = level.nz * shrink + 1;
+	}
+}
+
+// level_cost: expected cost of a ray crossing the level, as in the surface area heuristic. A ray 
+// that crosses the level visits each cell with probability SA(cell) / SA(level), where it pays a 
+// step and the intersection of the objects in the cell, so
+// cost = SA(cell) / SA(level) * (GRID_COST_STEP * cells + GRID_COST_INTERSECT * object references).
+// The references are counted from the bounding boxes of the objects.
+float Grid::level_cost(GridLevel& level, vector<unsigned int>& objs) {
+	AABB& box = level.bbox;
+	double wx = box.max.x - box.min.x, wy = box.max.y - box.min.y, wz = box.max.z - box.min.z;
+	double cx = wx / level.nx, cy = wy / level.ny, cz = wz / level.nz;
+	double refs = 0.0;
+
+	for (unsigned int o : objs) {
+		const AABB& obb = bounds[o];
+
+		int ixmin = clamp((obb.min.x - box.min.x) * level.nx / wx, 0, level.nx - 1);
+		int iymin = clamp((obb.min.y - box.min.y) * level.ny / wy, 0, level.ny - 1);
+		int izmin = clamp((obb.min.z - box.min.z) * level.nz / wz, 0, level.nz - 1);
+		int ixmax = clamp((obb.max.x - box.min.x) * level.nx / wx, 0, level.nx - 1);
+		int iymax = clamp((obb.max.y - box.min.y) * level.ny / wy, 0, level.ny - 1);
+		int izmax = clamp((obb.max.z - box.min.z) * level.nz / wz, 0, level.nz - 1);
+
+		refs += (double)(ixmax - ixmin + 1) * (iymax - iymin + 1) * (izmax - izmin + 1);
+	}
+
+	double cells = (double)level.nx * level.ny * level.nz;
+	double area_ratio = (cx * cy + cy * cz + cz * cx) / (wx * wy + wy * wz + wz * wx);
+
+	return (float)(area_ratio * (GRID_COST_STEP * cells + GRID_COST_INTERSECT * refs));
+}
+
+// ---------------------------------------------Calibrate
+// Tries densities of the top grid around the one of the cost model (the sub-grids keep theirs) by 
+// timing the closest hits of sample rays, typically a coarse set of primary rays, and rebuilds the 
+// grid with the fastest one.
+void Grid::Calibrate(vector<Object*>& objs, vector<Ray>& rays) {
+	static const float factors[] = { 0.5f, 0.7071f, 1.0f, 1.4142f, 2.0f };
+	float forced_m = m;  // restored at the end: 0 or the density set with setDensity
+
+	float model_density = levels.empty() ? 0.0f : levels[0].density;
+	if (model_density <= 0.0f) {
+		Build(objs);
+		if (levels.empty()) return;
+		model_density = levels[0].density;
+	}
+
+	float best_density = model_density;
+	double best_time = DBL_MAX;
+
+	for (float factor : factors) {
+		m = model_density * factor;
+		Build(objs);
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+		for (Ray& sample : rays) {
+			Ray ray = sample;
+			HitRecord hit;
+			Traverse(ray, hit);
+		}
+
+		double time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		printf("GRID calibration: density %.2f, %.4f s\n", m, time);
+
+		if (time < best_time) {
+			best_time = time;
+			best_density = m;
+		}
+	}
+
+	m = best_density;
+	Build(objs);
+	m = forced_m;  // the next Build chooses again, unless a density was forced
+}
+
+// fill_cells: appends the cells of levels[level_index] to the cell arrays and inserts objs in them.
+// Each object goes to the cells of its bounding box that it actually overlaps (Object::OverlapsBox, 
+// against the cell enlarged by a small margin), which is tested in parallel: every chunk of objects 
+// lists its (cell, object) pairs, in object order. Then two passes over the pairs, chunk by chunk, 
+// count the objects of every cell, which gives the offsets, and write every object index at its place.
+void Grid::fill_cells(unsigned int level_index, vector<unsigned int>& objs) {
+	GridLevel level = levels[level_index];
+	int level_cells = level.nx * level.ny * level.nz;
+	unsigned int first = level.first_cell;
+	unsigned int base = cell_offsets[first];  // end of the previous level
+
+	AABB& box = level.bbox;
+	Vector cell_size = Vector((box.max.x - box.min.x) / level.nx, (box.max.y - box.min.y) / level.ny, (box.max.z - box.min.z) / level.nz);
+	Vector margin = cell_size * GRID_OVERLAP_MARGIN;
+
+	int n_chunks = objs.size() >= GRID_PARALLEL_OBJECTS ? num_threads() : 1;
+	vector<vector<pair<unsigned int, unsigned int> > > chunk_refs(n_chunks);
+
+	parallel_for(0, objs.size(), n_chunks, [&](int chunk, int first_obj, int last_obj) {
+		vector<pair<unsigned int, unsigned int> >& refs = chunk_refs[chunk];
+
+		for (int k = first_obj; k < last_obj; k++) {
+			unsigned int o = objs[k];
+			const AABB& obb = bounds[o];
+
+			// Compute indices of both cells that contain min and max coord of obj bbox
+			int ixmin = clamp((obb.min.x - box.min.x) * level.nx / (box.max.x - box.min.x), 0, level.nx - 1);
+			int iymin = clamp((obb.min.y - box.min.y) * level.ny / (box.max.y - box.min.y), 0, level.ny - 1);
+			int izmin = clamp((obb.min.z - box.min.z) * level.nz / (box.max.z - box.min.z), 0, level.nz - 1);
+			int ixmax = clamp((obb.max.x - box.min.x) * level.nx / (box.max.x - box.min.x), 0, level.nx - 1);
+			int iymax = clamp((obb.max.y - box.min.y) * level.ny / (box.max.y - box.min.y), 0, level.ny - 1);
+			int izmax = clamp((obb.max.z - box.min.z) * level.nz / (box.max.z - box.min.z), 0, level.nz - 1);
+
+			bool single_cell = ixmin == ixmax && iymin == iymax && izmin == izmax;
+
+			// add the object to the cells
+			for (int iz = izmin; iz <= izmax; iz++) 					// cells in z direction
+				for (int iy = iymin; iy <= iymax; iy++)					// cells in y direction
+					for (int ix = ixmin; ix <= ixmax; ix++) {			// cells in x direction
+						if (!single_cell) {
+							Vector cell_min = Vector(box.min.x + ix * cell_size.x, box.min.y + iy * cell_size.y, box.min.z + iz * cell_size.z);
+							AABB cell_box = AABB(cell_min - margin, cell_min + cell_size + margin);
+							if (!objects[o]->OverlapsBox(cell_box)) continue;
+						}
+						refs.push_back(make_pair(first + ix + level.nx * iy + level.nx * level.ny * iz, o));
+					}
+		}
+	});
+
+	cell_offsets.resize(first + level_cells + 1);
+	fill(cell_offsets.begin() + first, cell_offsets.end(), 0);
+	cell_sub.resize(first + level_cells, 0);
+
+	for (auto& refs : chunk_refs)
+		for (auto& ref : refs)
+			cell_offsets[ref.first]++;
+
+	// counts -> end of every cell; the second pass moves them back to the start
+	unsigned int end = base;
+	for (int c = 0; c < level_cells; c++) {
+		end += cell_offsets[first + c];
+		cell_offsets[first + c] = end;
+	}
+	cell_offsets[first + level_cells] = end;
+	cell_prims.resize(end);
+
+	// backwards, so that every cell lists its objects in their original order
+	for (int chunk = n_chunks - 1; chunk >= 0; chunk--) {
+		vector<pair<unsigned int, unsigned int> >& refs = chunk_refs[chunk];
+		for (int i = (int)refs.size() - 1; i >= 0; i--)
+			cell_prims[--cell_offsets[refs[i].first]] = refs[i].second;
+	}
+}
+
+// Mailboxing: an object that overlaps several cells is intersected only in the first of them 
+// that a ray visits. Every thread numbers its rays and keeps one stamp per object with the 
+// number of the last ray tested against it, so traversals stay independent across threads.
+// Stamps left by other grids are always older than the current ray, so they never match.
+static thread_local vector<unsigned int> mailbox_stamps;
+static thread_local unsigned int mailbox_ray = 0;
+
+unsigned int* Grid::mailbox(unsigned int& ray_id) {
+	if (mailbox_stamps.size() < objects.size()) mailbox_stamps.resize(objects.size(), 0);
+
+	if (++mailbox_ray == 0) {  // wrapped around: old stamps could match again
+		fill(mailbox_stamps.begin(), mailbox_stamps.end(), 0);
+		mailbox_ray = 1;
 	}
 
-	printf("\nGRID: total cells = %d, total objects = %d, ResX = %d, ResY = %d, ResZ = %d\n\n", cellCount, this->getNumObjects(), nx, ny, nz);
-	//Erase the vector that stores object pointers, but don't delete the objects
-	objects.erase(objects.begin(), objects.end());
+	ray_id = mailbox_ray;
+	return mailbox_stamps.data();
 }
 
 //Setup function for Grid traversal according to Amanatides&Woo algorithm
-bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, 
+bool Grid::Init_Traverse(Ray& ray, GridLevel& level, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, 
 		double& tx_next, double& ty_next, double& tz_next, int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop) {
 
 		
@@ -110,12 +348,14 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	float dy = ray.direction.y;
 	float dz = ray.direction.z;
 
-	float x0 = bbox.min.x;
-	float y0 = bbox.min.y;
-	float z0 = bbox.min.z;
-	float x1 = bbox.max.x;
-	float y1 = bbox.max.y;
-	float z1 = bbox.max.z;
+	float x0 = level.bbox.min.x;
+	float y0 = level.bbox.min.y;
+	float z0 = level.bbox.min.z;
+	float x1 = level.bbox.max.x;
+	float y1 = level.bbox.max.y;
+	float z1 = level.bbox.max.z;
+
+	int nx = level.nx, ny = level.ny, nz = level.nz;
 
 	
 	float tx_min, ty_min, tz_min;
@@ -173,7 +413,7 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 
 	// Calculate initial cell coordinates
 		
-	if (bbox.isInside(ray.origin)) {  			// does the ray start inside the grid?
+	if (level.bbox.isInside(ray.origin)) {  			// does the ray start inside the grid?
 		ix = clamp((ox - x0) * nx / (x1 - x0), 0, nx - 1);
 		iy = clamp((oy - y0) * ny / (y1 - y0), 0, ny - 1);
 		iz = clamp((oz - z0) * nz / (z1 - z0), 0, nz - 1);
@@ -243,8 +483,12 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	return true;
 }
 
-//-----------------------------------------------------------------------GRID TRAVERSAL
-bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
+// walk: 3D-DDA through the cells of levels[level_index] crossed by the ray, descending into the 
+// sub-grids of dense cells with the same walk. The closest hit is accumulated in hit across 
+// cells and levels; shadow rays only look for any hit nearer than length and leave hit alone.
+// Returns WALK_DONE as soon as the result is known, WALK_EXITED when the ray leaves the level 
+// without it, and WALK_MISSED if the ray does not cross the level at all.
+Grid::WalkResult Grid::walk(Ray& ray, unsigned int level_index, bool shadow, double length, HitRecord& hit, unsigned int* stamps, unsigned int ray_id) {
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
 	double dtx, dty, dtz; 
@@ -252,109 +496,105 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 	int 	ix_step, iy_step, iz_step;
 	int 	ix_stop, iy_stop, iz_stop;
 
+	GridLevel& level = levels[level_index];
+
 	//Calculate the initial cell as well as the ray parameter increments per cell in the x, y, and z directions
-	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
-		return false;   //ray does not intersect the Grid bounding box
+	if (!Init_Traverse(ray, level, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
+		return WALK_MISSED;   //ray does not intersect the level bounding box
 
-	std::vector<Object*> objs;
-	float closestDistance;
-	Object* closestObj = NULL;
 	float distance;
-	
+
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-
-		closestDistance = FLT_MAX;
-		if (objs.size() != 0) 
-			for (auto obj : objs) //intersect Ray with all objects and find the closest hit point(if any)
-				if (obj->intercepts(ray, distance) && distance < closestDistance) {
-					closestDistance = distance;
-					closestObj = obj;
-				}
-		
-		if (tx_next < ty_next && tx_next < tz_next) {
-			if (closestDistance < tx_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin +ray.direction * closestDistance;
-					return true;
+		unsigned int cell = level.first_cell + ix + level.nx * iy + level.nx * level.ny * iz;
+		WalkResult sub_result = WALK_MISSED;
+
+		if (cell_sub[cell] != 0) {
+			sub_result = walk(ray, cell_sub[cell], shadow, length, hit, stamps, ray_id);
+			if (sub_result == WALK_DONE) return WALK_DONE;
+		}
+
+		// cells without a sub-grid, or whose sub-grid the ray only grazed: test the objects of the cell
+		if (sub_result == WALK_MISSED) {
+			for (unsigned int i = cell_offsets[cell]; i < cell_offsets[cell + 1]; i++) { //intersect Ray with all objects and find the closest hit point(if any)
+				unsigned int o = cell_prims[i];
+				if (stamps[o] == ray_id) continue;  // already tested in a previous cell
+				stamps[o] = ray_id;
+
+				if (!shadow) prims.intercepts(refs[o], ray, hit);
+				else if (prims.intercepts(refs[o], ray, distance) && distance < length) return WALK_DONE;
 			}
+		}
+
+		// the closest hit is final once the ray has crossed every cell in front of it
+		if (tx_next < ty_next && tx_next < tz_next) {
+			if (!shadow && hit.t < tx_next) return WALK_DONE;
 			tx_next += dtx;
 			ix += ix_step;
-			if (ix == ix_stop) return (false);
+			if (ix == ix_stop) return WALK_EXITED;
 		}
 
 		else if (ty_next < tz_next) {
-				if (closestDistance < ty_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin + ray.direction * closestDistance;
-					return true;
-				}
-				ty_next += dty;
-				iy += iy_step;
-				if (iy == iy_stop) return (false);
+			if (!shadow && hit.t < ty_next) return WALK_DONE;
+			ty_next += dty;
+			iy += iy_step;
+			if (iy == iy_stop) return WALK_EXITED;
 		}
 
 		else {
-			if (closestDistance < tz_next) {
-				*hitobject = closestObj;
-				hitpoint = ray.origin + ray.direction * closestDistance;
-				return true;
-			}
+			if (!shadow && hit.t < tz_next) return WALK_DONE;
 			tz_next += dtz;
 			iz += iz_step;
-			if (iz == iz_stop) return (false);
+			if (iz == iz_stop) return WALK_EXITED;
 		}
-		
 	}
 }
 
+//-----------------------------------------------------------------------GRID TRAVERSAL
+// The closest hit is kept across cells: a mailboxed object is not tested again in the 
+// next cells, so a hit found beyond the current cell must be remembered until the ray gets there
+bool Grid::Traverse(Ray& ray, HitRecord& hit) {
+	float t_max = hit.t;
+	unsigned int ray_id;
+	unsigned int* stamps = mailbox(ray_id);
+
+	// a plane hit ends the walk once the ray has crossed the cells in front of it
+	intercepts_unbounded(ray, hit);
+
+	if (!objects.empty()) walk(ray, 0, false, FLT_MAX, hit, stamps, ray_id);
+	return hit.t < t_max;
+}
+
 //-----------------------------------------------------------------------GRID TRAVERSAL FOR SHADOW RAY
-bool Grid::Traverse(Ray& ray) {  
+bool Grid::Traverse(const Ray& shadow_ray, float length) {
 
-	double length = ray.direction.length(); //distance between light and intersection point
-	ray.direction.normalize();
+	Ray ray = shadow_ray;  // the walk takes a Ray&
 
-	int ix, iy, iz;
-	double 	tx_next, ty_next, tz_next;
-	double dtx, dty, dtz;
+	HitRecord hit;  // not filled by the shadow walk
+	unsigned int ray_id;
+	unsigned int* stamps = mailbox(ray_id);
 
-	int 	ix_step, iy_step, iz_step;
-	int 	ix_stop, iy_stop, iz_stop;
+	if (intercepts_unbounded(ray, length)) return true;
+	if (objects.empty()) return false;
 
-	/*Calculate the initial cell as well as the ray parameter increments per cell in the x, y, and z directions
-	Shadow ray always intersect the Grid bounding box. However due to rounding it may starts at the boundaries, which may result as no intersecting. Consider it as in shadow. */
-	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
-		return true;
+	/*Shadow ray always intersect the Grid bounding box. However due to rounding it may starts at the boundaries, which may result as no intersecting. Consider it as in shadow. 
+	Rays from planes may start anywhere, though, and miss the grid. */
+	WalkResult result = walk(ray, 0, true, length, hit, stamps, ray_id);
 
-	std::vector<Object*> objs;
-	float distance;
+	if (result == WALK_MISSED) return bbox.isInside(ray.origin);
+	return result != WALK_EXITED;
+}
 
-	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-		if (objs.size() != 0) 
-			//intersect Ray with all objects of each cell
-			for (auto &obj : objs) {
-				if (obj->intercepts(ray, distance) && distance < length) 
-					return true;
-			}
-		
-		if (tx_next < ty_next && tx_next < tz_next) {
-			tx_next += dtx;
-			ix += ix_step;
-			if (ix == ix_stop) return (false);
-		}
-		else {
-			if (ty_next < tz_next) {
-				
-				ty_next += dty;
-				iy += iy_step;
-				if (iy == iy_stop) return (false);
-			}
-			else {
-				tz_next += dtz;
-				iz += iz_step;
-				if (iz == iz_stop) return (false);
-			}
-		}
-	}
+AcceleratorStats Grid::getStats() {
+	AcceleratorStats stats;
+
+	stats.nodes = cell_offsets.empty() ? 0 : cell_offsets.size() - 1;
+	stats.leaves = 0;
+	stats.references = cell_prims.size();
+	stats.memory = (cell_offsets.size() + cell_prims.size() + cell_sub.size()) * sizeof(unsigned int) + 
+		levels.size() * sizeof(GridLevel) + objects.size() * sizeof(Object*) + refs.size() * sizeof(PrimRef) + prims.getMemory();
+
+	for (size_t c = 0; c < stats.nodes; c++)
+		if (cell_offsets[c + 1] > cell_offsets[c]) stats.leaves++;
+
+	return stats;
 }
@@ -0,0 +1,155 @@
+#include "instance.h"
+#include "maths.h"
+#include "macros.h"
+
+// --------------------------------------------------------------------- Transform
+Transform Transform::identity(void) {
+	Transform tr;
+
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) tr.m[i][j] = i == j ? 1.0f : 0.0f;
+		tr.t[i] = 0.0f;
+	}
+	return tr;
+}
+
+Transform Transform::compose(const Vector& translate, const Vector& rotate_degrees, const Vector& scale) {
+	float angles[3] = { rotate_degrees.x * PI / 180.0f, rotate_degrees.y * PI / 180.0f, rotate_degrees.z * PI / 180.0f };
+	float scales[3] = { scale.x, scale.y, scale.z };
+	Transform tr = identity();
+
+	// rotations around x, then y, then z: each one multiplies from the left
+	for (int axis = 0; axis < 3; axis++) {
+		int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+		float c = cos(angles[axis]), s = sin(angles[axis]);
+
+		for (int j = 0; j < 3; j++) {
+			float r1 = tr.m[a1][j], r2 = tr.m[a2][j];
+			tr.m[a1][j] = c * r1 - s * r2;
+			tr.m[a2][j] = s * r1 + c * r2;
+		}
+	}
+
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++) tr.m[i][j] *= scales[j];
+
+	tr.t[0] = translate.x; tr.t[1] = translate.y; tr.t[2] = translate.z;
+	return tr;
+}
+
+Transform Transform::inverse(void) const {
+	Transform inv;
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+		m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+		m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	double inv_det = 1.0 / det;
+
+	// adjugate over the determinant
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			int r1 = (j + 1) % 3, r2 = (j + 2) % 3, c1 = (i + 1) % 3, c2 = (i + 2) % 3;
+			inv.m[i][j] = (float)((m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1]) * inv_det);
+		}
+	}
+
+	for (int i = 0; i < 3; i++)
+		inv.t[i] = -(inv.m[i][0] * t[0] + inv.m[i][1] * t[1] + inv.m[i][2] * t[2]);
+
+	return inv;
+}
+
+Vector Transform::point(const Vector& p) const {
+	return Vector(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + t[0],
+		m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + t[1],
+		m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + t[2]);
+}
+
+Vector Transform::direction(const Vector& v) const {
+	return Vector(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+		m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+		m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+}
+
+Vector Transform::normal(const Vector& n) const {
+	return Vector(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+		m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+		m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+}
+
+// --------------------------------------------------------------------- Mesh
+Mesh::Mesh(void) : bbox(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX)) {}
+
+Mesh::Mesh(TriangleMesh* geometry_) : Mesh() {
+	geometry = geometry_;
+	objects.reserve(geometry->getNumFaces());
+	for (int i = 0; i < geometry->getNumFaces(); i++)
+		addObject(geometry->getFace(i));
+}
+
+Mesh::~Mesh() {
+	delete blas;
+	delete geometry;
+}
+
+void Mesh::addObject(Object* o) {
+	objects.push_back(o);
+	bbox.extend(o->GetBoundingBox());
+}
+
+Accelerator* Mesh::getBLAS() {
+	if (blas == NULL) {
+		blas = new BVH();
+		blas->Build(objects);
+	}
+	return blas;
+}
+
+// --------------------------------------------------------------------- Instance
+Instance::Instance(Mesh* mesh_, const Transform& to_world_) : mesh(mesh_), to_world(to_world_) {
+	to_mesh = to_world.inverse();
+	m_Material = mesh->getNumObjects() > 0 ? mesh->getObject(0)->GetMaterial() : NULL;
+
+	// bounds of the transformed corners of the mesh bounds
+	AABB mesh_bbox = mesh->GetBoundingBox();
+	bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+	for (int corner = 0; corner < 8; corner++) {
+		Vector p = Vector(corner & 1 ? mesh_bbox.max.x : mesh_bbox.min.x, corner & 2 ? mesh_bbox.max.y : mesh_bbox.min.y, corner & 4 ? mesh_bbox.max.z : mesh_bbox.min.z);
+		p = to_world.point(p);
+		bbox.extend(AABB(p, p));
+	}
+
+	mesh->getBLAS();
+}
+
+bool Instance::intercepts(Ray& r, float& t) {
+	HitRecord hit;
+
+	if (!intercepts(r, hit)) return false;
+
+	t = hit.t;
+	return true;
+}
+
+// The ray is traced through the BLAS with a normalized direction, so distances in mesh
+// coordinates are the world ones times the length of the transformed world direction.
+bool Instance::intercepts(Ray& r, HitRecord& hit) {
+	float t_box;
+
+	if (!bbox.intercepts(r, t_box)) return false;  // cheaper than transforming the ray
+
+	Vector mesh_dir = to_mesh.direction(r.direction);
+	float scale = mesh_dir.length();
+	Ray ray = Ray(to_mesh.point(r.origin), mesh_dir / scale);
+	HitRecord mesh_hit;
+
+	mesh_hit.t = hit.t * scale;
+	if (!mesh->getBLAS()->Traverse(ray, mesh_hit)) return false;
+
+	float t = mesh_hit.t / scale;
+	if (t >= hit.t) return false;
+
+	Vector normal = to_mesh.normal(mesh_hit.normal);
+	hit.set(t, this, normal.normalize(), mesh_hit.u, mesh_hit.v);
+	return true;
+}
@@ -0,0 +1,60 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "scene.h"
+#include "rayAccelerator.h"
+
+// Affine transform: a 3x3 linear part and a translation, applied as m * p + t
+struct Transform {
+	float m[3][3];
+	float t[3];
+
+	static Transform identity(void);
+	static Transform compose(const Vector& translate, const Vector& rotate_degrees, const Vector& scale);  // scale, rotate around x, y, z, translate
+	Transform inverse(void) const;
+	Vector point(const Vector& p) const;
+	Vector direction(const Vector& v) const;
+	Vector normal(const Vector& n) const;  // by the transpose: gives the normals of this->inverse()
+};
+
+// Geometry of a p3f mesh with its own acceleration structure (BLAS), shared by all its instances.
+// The triangles are in the coordinates of the mesh command; a meshdef command declares the same
+// geometry without placing it, so only its instances are drawn.
+class Mesh
+{
+public:
+	Mesh(void);
+	Mesh(TriangleMesh* geometry_);  // all the faces of geometry_, which the mesh then owns
+	~Mesh();
+	void addObject(Object* o);
+	int getNumObjects() { return objects.size(); }
+	Object* getObject(unsigned int index) { return objects[index]; }
+	AABB GetBoundingBox() { return bbox; }
+	Accelerator* getBLAS();  // built on the first call
+
+private:
+	vector<Object*> objects;
+	AABB bbox;
+	BVH* blas = NULL;
+	TriangleMesh* geometry = NULL;  // vertices, indices and faces, deleted with the mesh
+};
+
+// A mesh placed in the scene by a transform. The scene acceleration structure holds instances
+// like any other object, as its top level (TLAS): rays that reach an instance are transformed
+// into mesh coordinates and traced through the BLAS of the mesh, so instances cost no geometry
+// and moving one only needs the scene structure to be rebuilt.
+class Instance : public Object
+{
+public:
+	Instance(Mesh* mesh_, const Transform& to_world_);
+	bool intercepts(Ray& r, float& t);
+	bool intercepts(Ray& r, HitRecord& hit);  // hit.prim is the instance, for its material
+	AABB GetBoundingBox(void) { return bbox; }
+
+private:
+	Mesh* mesh;
+	Transform to_world, to_mesh;
+	AABB bbox;
+};
+
+#endif
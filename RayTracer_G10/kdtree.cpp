@@ -0,0 +1,286 @@
+#include "rayAccelerator.h"
+#include "macros.h"
+
+void KdTree::KdNode::makeLeaf(unsigned int first_, unsigned int n_objs_) {
+	this->first = first_;
+	this->flags = 3 | (n_objs_ << 2);
+}
+
+void KdTree::KdNode::makeNode(int axis_, float split_, unsigned int above_) {
+	this->split = split_;
+	this->flags = axis_ | (above_ << 2);
+}
+
+KdTree::KdTree(void) {}
+
+int KdTree::getNumObjects() { return objects.size(); }
+
+// Build: the tree may be as deep as 8 + 1.3 log2(n), which is enough for the SAH to
+// isolate every object in well distributed scenes, up to KD_MAX_DEPTH.
+void KdTree::Build(vector<Object*>& objs) {
+	split_unbounded(objs, objects);
+	if (!store_primitives(objects)) objects.clear();  // too many primitives: the tree is left empty
+	nodes.clear();
+	leaf_prims.clear();
+
+	AABB world_bbox = store_bounds(objects);
+
+	//slightly enlarge the box just for case; the tree is built in the exact box, where no split 
+	//candidate cuts off the slivers of empty space added here
+	bbox = world_bbox;
+	bbox.min.x -= EPSILON; bbox.min.y -= EPSILON; bbox.min.z -= EPSILON;
+	bbox.max.x += EPSILON; bbox.max.y += EPSILON; bbox.max.z += EPSILON;
+
+	max_depth = (int)(8 + 1.3f * log2((float)objects.size() + 1.0f));
+	if (max_depth > KD_MAX_DEPTH) max_depth = KD_MAX_DEPTH;
+
+	vector<unsigned int> prims(objects.size());
+	for (unsigned int i = 0; i < prims.size(); i++) prims[i] = i;
+
+	if (!objects.empty()) build_recursive(world_bbox, prims, 0, 0);
+
+	free_bounds();
+
+	AcceleratorStats stats = getStats();
+	printf("\nKD-TREE: nodes = %d, leaves = %d, object references = %d, max depth = %d\n\n",
+		(int)stats.nodes, (int)stats.leaves, (int)stats.references, max_depth);
+}
+
+// build_recursive: appends the subtree of the node with the objects prims inside node_bbox.
+// Every split candidate at the start or end of an object bounds, on the three axes, is costed
+// with the SAH by sweeping the sorted bounds; the node becomes a leaf when no split is cheaper
+// than intersecting all its objects, or after three splits in a row that did not pay off
+// (bad_refines), since splits that look bad can still lead to good ones further down.
+void KdTree::build_recursive(AABB& node_bbox, vector<unsigned int>& prims, int depth, int bad_refines) {
+	unsigned int node_index = nodes.size();
+	unsigned int n_prims = prims.size();
+
+	nodes.push_back(KdNode());
+
+	if (n_prims <= 1 || depth >= max_depth) {
+		nodes[node_index].makeLeaf(leaf_prims.size(), n_prims);
+		leaf_prims.insert(leaf_prims.end(), prims.begin(), prims.end());
+		return;
+	}
+
+	float extent[3] = { node_bbox.max.x - node_bbox.min.x, node_bbox.max.y - node_bbox.min.y, node_bbox.max.z - node_bbox.min.z };
+	float inv_area = 1.0f / node_bbox.surface_area();
+	float leaf_cost = KD_COST_INTERSECT * n_prims;
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	unsigned int best_edge = 0;
+	vector<KdEdge> edges[3];
+
+	for (int axis = 0; axis < 3; axis++) {
+		int axis1 = (axis + 1) % 3, axis2 = (axis + 2) % 3;
+		float node_min = node_bbox.min.getAxisValue(axis), node_max = node_bbox.max.getAxisValue(axis);
+		vector<KdEdge>& axis_edges = edges[axis];
+
+		axis_edges.resize(2 * n_prims);
+		for (unsigned int i = 0; i < n_prims; i++) {
+			AABB& prim_bbox = bounds[prims[i]];
+			axis_edges[2 * i] = { max(prim_bbox.min.getAxisValue(axis), node_min), prims[i], true };
+			axis_edges[2 * i + 1] = { min(prim_bbox.max.getAxisValue(axis), node_max), prims[i], false };
+		}
+		sort(axis_edges.begin(), axis_edges.end());
+
+		// sweep the plane from below: the objects ending at an edge leave the above side
+		// before it is costed, the ones starting at it join the below side afterwards
+		unsigned int n_below = 0, n_above = n_prims;
+
+		for (unsigned int e = 0; e < 2 * n_prims; e++) {
+			if (!axis_edges[e].start) n_above--;
+
+			float t = axis_edges[e].t;
+			if (t > node_min && t < node_max) {
+				float cap_area = extent[axis1] * extent[axis2];
+				float perimeter = extent[axis1] + extent[axis2];
+				float p_below = 2.0f * (cap_area + (t - node_min) * perimeter) * inv_area;
+				float p_above = 2.0f * (cap_area + (node_max - t) * perimeter) * inv_area;
+				float bonus = (n_below == 0 || n_above == 0) ? KD_EMPTY_BONUS : 0.0f;
+				float cost = KD_COST_TRAVERSAL + KD_COST_INTERSECT * (1.0f - bonus) * (p_below * n_below + p_above * n_above);
+
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_edge = e;
+				}
+			}
+
+			if (axis_edges[e].start) n_below++;
+		}
+	}
+
+	if (best_cost > leaf_cost) bad_refines++;
+
+	if (best_axis == -1 || bad_refines == 3 || (best_cost > 4.0f * leaf_cost && n_prims < 16)) {
+		nodes[node_index].makeLeaf(leaf_prims.size(), n_prims);
+		leaf_prims.insert(leaf_prims.end(), prims.begin(), prims.end());
+		return;
+	}
+
+	// objects starting before the split edge go below, the ones ending after it go above
+	vector<KdEdge>& split_edges = edges[best_axis];
+	vector<unsigned int> below, above;
+	float split = split_edges[best_edge].t;
+
+	for (unsigned int e = 0; e < best_edge; e++)
+		if (split_edges[e].start) below.push_back(split_edges[e].prim);
+	for (unsigned int e = best_edge + 1; e < 2 * n_prims; e++)
+		if (!split_edges[e].start) above.push_back(split_edges[e].prim);
+
+	for (int axis = 0; axis < 3; axis++) {
+		edges[axis].clear();
+		edges[axis].shrink_to_fit();
+	}
+	prims.clear();
+	prims.shrink_to_fit();
+
+	AABB below_bbox = node_bbox, above_bbox = node_bbox;
+	below_bbox.max.setAxisValue(best_axis, split);
+	above_bbox.min.setAxisValue(best_axis, split);
+
+	build_recursive(below_bbox, below, depth + 1, bad_refines);
+	unsigned int above_index = nodes.size();
+	build_recursive(above_bbox, above, depth + 1, bad_refines);
+
+	nodes[node_index].makeNode(best_axis, split, above_index);
+}
+
+// clip: range [t_min, t_max] of the ray inside the tree bounds; false if it misses them
+bool KdTree::clip(float* origin, float* inv_dir, float& t_min, float& t_max) {
+	t_min = 0.0f;
+	t_max = FLT_MAX;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float t0 = (bbox.min.getAxisValue(axis) - origin[axis]) * inv_dir[axis];
+		float t1 = (bbox.max.getAxisValue(axis) - origin[axis]) * inv_dir[axis];
+
+		if (t0 > t1) swap(t0, t1);
+		if (t0 > t_min) t_min = t0;
+		if (t1 < t_max) t_max = t1;  // NaN (origin on a slab of a parallel ray) keeps the range
+		if (t_min > t_max) return false;
+	}
+	return true;
+}
+
+// Traverse: walks the leaves along the ray from front to back. At each interior node
+// the child on the side of the ray origin is visited first and the far child is pushed
+// with the range of the ray behind the split plane, unless the ray does not reach it.
+// Objects split across leaves may report hits beyond the current leaf, so the search only
+// ends when the next node starts beyond the closest hit.
+bool KdTree::Traverse(Ray& ray, HitRecord& hit) {
+	float t_min, t_max;
+	float t_limit = hit.t;
+	StackItem stack[KD_STACK_SIZE];
+	int stack_size = 0;
+	float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	float dir[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	float inv_dir[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+
+	intercepts_unbounded(ray, hit);  // a plane in front of the objects ends the walk early
+
+	unsigned int node_index = 0;
+	bool walk = !nodes.empty() && clip(origin, inv_dir, t_min, t_max);
+
+	while (walk) {
+		if (hit.t < t_min) break;
+
+		KdNode& node = nodes[node_index];
+
+		if (!node.isLeaf()) {
+			int axis = node.getAxis();
+			float t_split = (node.getSplit() - origin[axis]) * inv_dir[axis];
+			bool below_first = origin[axis] < node.getSplit() || (origin[axis] == node.getSplit() && dir[axis] <= 0);
+			unsigned int near_child = below_first ? node_index + 1 : node.getAbove();
+			unsigned int far_child = below_first ? node.getAbove() : node_index + 1;
+
+			if (t_split > t_max || t_split <= 0) node_index = near_child;
+			else if (t_split < t_min) node_index = far_child;
+			else {
+				stack[stack_size++] = { far_child, t_split, t_max };
+				node_index = near_child;
+				t_max = t_split;
+			}
+			continue;
+		}
+
+		for (unsigned int i = node.getFirst(); i < node.getFirst() + node.getNObjs(); i++)
+			prims.intercepts(refs[leaf_prims[i]], ray, hit);
+
+		if (stack_size == 0) break;
+		stack_size--;
+		node_index = stack[stack_size].node;
+		t_min = stack[stack_size].t_min;
+		t_max = stack[stack_size].t_max;
+	}
+
+	return hit.t < t_limit;
+}
+
+// Traverse(with shadow ray): the same walk over the part of the ray closer than the light
+// (length), which ends at the first hit
+bool KdTree::Traverse(const Ray& shadow_ray, float length) {
+	Ray ray = shadow_ray;  // the primitive tests take a Ray&
+	float t_min, t_max, tmp;
+
+	StackItem stack[KD_STACK_SIZE];
+	int stack_size = 0;
+	float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	float dir[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	float inv_dir[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+
+	if (intercepts_unbounded(ray, length)) return true;
+	if (nodes.empty() || !clip(origin, inv_dir, t_min, t_max) || t_min > length) return false;
+	if (t_max > length) t_max = length;
+
+	unsigned int node_index = 0;
+
+	while (true) {
+		KdNode& node = nodes[node_index];
+
+		if (!node.isLeaf()) {
+			int axis = node.getAxis();
+			float t_split = (node.getSplit() - origin[axis]) * inv_dir[axis];
+			bool below_first = origin[axis] < node.getSplit() || (origin[axis] == node.getSplit() && dir[axis] <= 0);
+			unsigned int near_child = below_first ? node_index + 1 : node.getAbove();
+			unsigned int far_child = below_first ? node.getAbove() : node_index + 1;
+
+			if (t_split > t_max || t_split <= 0) node_index = near_child;
+			else if (t_split < t_min) node_index = far_child;
+			else {
+				stack[stack_size++] = { far_child, t_split, t_max };
+				node_index = near_child;
+				t_max = t_split;
+			}
+			continue;
+		}
+
+		for (unsigned int i = node.getFirst(); i < node.getFirst() + node.getNObjs(); i++) {
+			if (prims.intercepts(refs[leaf_prims[i]], ray, tmp) && tmp < length) return true;
+		}
+
+		if (stack_size == 0) break;
+		stack_size--;
+		node_index = stack[stack_size].node;
+		t_min = stack[stack_size].t_min;
+		t_max = stack[stack_size].t_max;
+	}
+
+	return false;
+}
+
+AcceleratorStats KdTree::getStats() {
+	AcceleratorStats stats;
+
+	stats.nodes = nodes.size();
+	stats.leaves = 0;
+	stats.references = leaf_prims.size();
+	stats.memory = nodes.size() * sizeof(KdNode) + leaf_prims.size() * sizeof(unsigned int) + objects.size() * sizeof(Object*) +
+		refs.size() * sizeof(PrimRef) + prims.getMemory();
+
+	for (KdNode& node : nodes)
+		if (node.isLeaf()) stats.leaves++;
+
+	return stats;
+}
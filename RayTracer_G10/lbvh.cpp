@@ -0,0 +1,429 @@
+#include "rayAccelerator.h"
+#include "macros.h"
+#include "parallel.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// Linear BVH builder (LBVH): the objects are sorted along a Morton curve through their
+// centroids and the hierarchy is read off the sorted codes (T. Karras, "Maximizing Parallelism
+// in the Construction of BVHs, Octrees, and k-d Trees", HPG 2012), optionally followed by one
+// pass of treelet restructuring (T. Karras, T. Aila, "Fast Parallel Construction of
+// High-Quality Bounding Volume Hierarchies", HPG 2013).
+// Much faster than the SAH build and somewhat worse trees; the binary tree is emitted in the
+// same node layout as Build, so it is collapsed and traversed in the same way.
+
+// ---------------------------------------------------- expand_bits
+// spreads the low 21 bits of v so that two zero bits follow each one
+static inline uint64_t expand_bits(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+	return v;
+}
+
+// ---------------------------------------------------- clz64
+static inline int clz64(uint64_t v) {
+#ifdef _MSC_VER
+	unsigned long bit;
+	if (_BitScanReverse(&bit, (unsigned long)(v >> 32))) return 31 - (int)bit;
+	if (_BitScanReverse(&bit, (unsigned long)v)) return 63 - (int)bit;
+	return 64;
+#else
+	return v ? __builtin_clzll(v) : 64;
+#endif
+}
+
+// ---------------------------------------------------- radix_sort
+// LSD radix sort of the codes, 8 bits per pass. Every chunk counts its digits, the counts
+// are turned into offsets in (digit, chunk) order and every chunk scatters its own objects,
+// so the sort is stable and gives the same order for any number of chunks.
+template <class MortonPrim>
+static void radix_sort(vector<MortonPrim>& prims, int bits, int n_chunks) {
+	int n = prims.size();
+	vector<MortonPrim> sorted(n);
+	vector<unsigned int> offsets(n_chunks * 256);
+
+	for (int shift = 0; shift < bits; shift += 8) {
+		fill(offsets.begin(), offsets.end(), 0);
+
+		parallel_for(0, n, n_chunks, [&](int chunk, int first, int last) {
+			unsigned int* count = &offsets[chunk * 256];
+			for (int i = first; i < last; i++)
+				count[(prims[i].code >> shift) & 255]++;
+		});
+
+		unsigned int sum = 0;
+		for (int digit = 0; digit < 256; digit++) {
+			for (int chunk = 0; chunk < n_chunks; chunk++) {
+				unsigned int count = offsets[chunk * 256 + digit];
+				offsets[chunk * 256 + digit] = sum;
+				sum += count;
+			}
+		}
+
+		parallel_for(0, n, n_chunks, [&](int chunk, int first, int last) {
+			unsigned int* offset = &offsets[chunk * 256];
+			for (int i = first; i < last; i++)
+				sorted[offset[(prims[i].code >> shift) & 255]++] = prims[i];
+		});
+
+		prims.swap(sorted);
+	}
+}
+
+void BVH::setTreeletOptimization(bool optimize) { this->treelet_optimization = optimize; }
+
+void BVH::BuildLinear(vector<Object *> &all_objs) {
+	AABB world_bbox;
+	uint64_t key;
+
+	if (!init_build(all_objs, treelet_optimization ? BVH_BUILDER_LINEAR_TREELETS : BVH_BUILDER_LINEAR, world_bbox, key)) return;
+
+	int n = build_prims.size();
+	int n_chunks = parallel_build ? num_threads() : 1;
+
+	fork_depth = 0;
+	if (parallel_build)
+		while ((1 << fork_depth) < 4 * n_chunks) fork_depth++;
+
+	// bounds of the centroids, which the Morton grid spans
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	AABB centroid_bbox = AABB(min, max);
+	vector<AABB> chunk_bbox(n_chunks, centroid_bbox);
+
+	parallel_for(0, n, n_chunks, [&](int chunk, int first, int last) {
+		for (int i = first; i < last; i++) {
+			Vector& c = build_prims[i].centroid;
+			chunk_bbox[chunk].extend(AABB(c, c));
+		}
+	});
+
+	for (AABB& bbox : chunk_bbox)
+		centroid_bbox.extend(bbox);
+
+	// 10 bits per axis for small scenes, 21 for large meshes where 30-bit codes would collide
+	int axis_bits = n < BVH_LBVH_WIDE_CODES ? 10 : 21;
+	float cells = (float)((1 << axis_bits) - 1);
+	float c_min[3], scale[3];
+
+	for (int axis = 0; axis < 3; axis++) {
+		c_min[axis] = centroid_bbox.min.getAxisValue(axis);
+		float extent = centroid_bbox.max.getAxisValue(axis) - c_min[axis];
+		scale[axis] = extent > 0.0f ? cells / extent : 0.0f;
+	}
+
+	vector<MortonPrim> morton(n);
+
+	parallel_for(0, n, n_chunks, [&](int /*chunk*/, int first, int last) {
+		for (int i = first; i < last; i++) {
+			uint64_t code = 0;
+			for (int axis = 0; axis < 3; axis++) {
+				float q = (build_prims[i].centroid.getAxisValue(axis) - c_min[axis]) * scale[axis];
+				code |= expand_bits((uint64_t)(q < cells ? q : cells)) << (2 - axis);
+			}
+			morton[i].code = code;
+			morton[i].index = i;
+		}
+	});
+
+	radix_sort(morton, 3 * axis_bits, n_chunks);
+
+	// build primitives in Morton order: every subtree covers a contiguous range of them
+	vector<BuildPrim> sorted_prims(n);
+	parallel_for(0, n, n_chunks, [&](int /*chunk*/, int first, int last) {
+		for (int i = first; i < last; i++)
+			sorted_prims[i] = build_prims[morton[i].index];
+	});
+	build_prims.swap(sorted_prims);
+	sorted_prims.clear();
+
+	// Karras: interior node i of the n - 1 covers the objects between i and some j, and is split
+	// after object split[i]; the children are interior nodes split[i] and split[i] + 1.
+	// Equal codes are told apart by their index, which keeps the hierarchy a valid binary tree.
+	auto delta = [&](int i, int j) -> int {
+		if (j < 0 || j >= n) return -1;
+		if (morton[i].code == morton[j].code) return 64 + clz64((uint64_t)(i ^ j));
+		return clz64(morton[i].code ^ morton[j].code);
+	};
+
+	vector<unsigned int> split(n > 1 ? n - 1 : 0);
+
+	parallel_for(0, n - 1, n_chunks, [&](int /*chunk*/, int first, int last) {
+		for (int i = first; i < last; i++) {
+			// direction of the range and its length, by exponential then binary search
+			int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+			int delta_min = delta(i, i - d);
+
+			int l_max = 2;
+			while (delta(i, i + l_max * d) > delta_min) l_max *= 2;
+
+			int l = 0;
+			for (int t = l_max / 2; t >= 1; t /= 2)
+				if (delta(i, i + (l + t) * d) > delta_min) l += t;
+
+			// split: the last object sharing more leading bits with i than the whole range does
+			int delta_node = delta(i, i + l * d);
+			int s = 0;
+			for (int div = 2; ; div *= 2) {
+				int t = (l + div - 1) / div;
+				if (delta(i, i + (s + t) * d) > delta_node) s += t;
+				if (t == 1) break;
+			}
+
+			split[i] = i + s * d + (d < 0 ? -1 : 0);
+		}
+	});
+
+	morton.clear();
+	morton.shrink_to_fit();
+
+	vector<LinearNode> tree;
+	tree.reserve(n > 0 ? 2 * n : 1);
+	linear_tree(tree, split, 0, 0, n > 0 ? n - 1 : 0);
+
+	if (treelet_optimization)
+		optimize_treelets(tree, 0, 0);
+
+	emit_linear(tree, 0, 0, 0);
+	nodes[0].setAABB(world_bbox);
+
+	finish_build(key);
+}
+
+// linear_tree: appends to tree the subtree of Karras interior node `node`, which covers the
+// objects first to last; ranges of at most leaf_size objects become leaves.
+// Returns the index of the subtree root in tree.
+int BVH::linear_tree(vector<LinearNode>& tree, vector<unsigned int>& split, unsigned int node, unsigned int first, unsigned int last) {
+	int index = tree.size();
+	tree.push_back(LinearNode());
+
+	unsigned int n_objs = build_prims.empty() ? 0 : last - first + 1;
+
+	if (n_objs <= (unsigned int)leaf_size) {
+		Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		AABB bbox = AABB(min, max);
+
+		for (unsigned int i = first; i < first + n_objs; i++)
+			bbox.extend(build_prims[i].bbox);
+
+		LinearNode& leaf = tree[index];
+		leaf.bbox = bbox;
+		leaf.cost = n_objs ? bbox.surface_area() * n_objs : 0.0f;
+		leaf.left = leaf.right = -1;
+		leaf.first = first;
+		leaf.n_objs = n_objs;
+	}
+	else {
+		unsigned int gamma = split[node];
+		int left = linear_tree(tree, split, gamma, first, gamma);
+		int right = linear_tree(tree, split, gamma + 1, gamma + 1, last);
+
+		AABB bbox = tree[left].bbox;
+		bbox.extend(tree[right].bbox);
+
+		LinearNode& interior = tree[index];  // taken after the recursion, which reallocates tree
+		interior.bbox = bbox;
+		interior.cost = bbox.surface_area() + tree[left].cost + tree[right].cost;
+		interior.left = left;
+		interior.right = right;
+		interior.first = first;
+		interior.n_objs = n_objs;
+	}
+
+	return index;
+}
+
+// optimize_treelets: restructures the treelet of every interior node, children before parents
+// so that each treelet is built from already optimized subtrees. Disjoint subtrees are
+// optimized at the same time over the first fork_depth levels.
+void BVH::optimize_treelets(vector<LinearNode>& tree, int node, int depth) {
+	if (tree[node].left < 0) return;
+
+	int left = tree[node].left, right = tree[node].right;
+
+	if (depth < fork_depth && tree[node].n_objs >= BVH_PARALLEL_SUBTREE) {
+		thread left_optimizer([&]() { this->optimize_treelets(tree, left, depth + 1); });
+		optimize_treelets(tree, right, depth + 1);
+		left_optimizer.join();
+	}
+	else {
+		optimize_treelets(tree, left, depth + 1);
+		optimize_treelets(tree, right, depth + 1);
+	}
+
+	restructure_treelet(tree, node);
+}
+
+// restructure_treelet: grows a treelet of up to BVH_TREELET_LEAVES leaves under root by
+// opening its largest leaves, finds the topology of minimum SAH cost over these leaves by
+// dynamic programming on subsets, and rebuilds the treelet with it if that is cheaper.
+// The interior nodes of the treelet are reused, so the tree does not grow.
+void BVH::restructure_treelet(vector<LinearNode>& tree, int root) {
+	int leaves[BVH_TREELET_LEAVES], internals[BVH_TREELET_LEAVES - 1];
+	int n_leaves = 2, n_internals = 1;
+
+	leaves[0] = tree[root].left;
+	leaves[1] = tree[root].right;
+	internals[0] = root;
+
+	while (n_leaves < BVH_TREELET_LEAVES) {
+		int largest = -1;
+		float largest_area = -1.0f;
+
+		for (int i = 0; i < n_leaves; i++) {
+			LinearNode& leaf = tree[leaves[i]];
+			if (leaf.left < 0) continue;
+
+			float area = leaf.bbox.surface_area();
+			if (area > largest_area) { largest_area = area; largest = i; }
+		}
+		if (largest < 0) break;
+
+		int opened = leaves[largest];
+		internals[n_internals++] = opened;
+		leaves[largest] = tree[opened].left;
+		leaves[n_leaves++] = tree[opened].right;
+	}
+
+	if (n_leaves < 3) return;  // a node with two children has a single topology
+
+	// optimal cost of every subset of the leaves, and the partition that gives it
+	const int n_subsets = 1 << BVH_TREELET_LEAVES;
+	AABB bbox[n_subsets];
+	float cost[n_subsets];
+	int partition[n_subsets];
+	int full = (1 << n_leaves) - 1;
+
+	for (int s = 1; s <= full; s++) {
+		int low = s & (~s + 1);  // lowest leaf of the subset
+
+		if (s == low) {
+			int leaf = 0;
+			while ((1 << leaf) != s) leaf++;
+			bbox[s] = tree[leaves[leaf]].bbox;
+			cost[s] = tree[leaves[leaf]].cost;
+			continue;
+		}
+
+		bbox[s] = bbox[low];
+		bbox[s].extend(bbox[s ^ low]);
+
+		// partitions (p, s ^ p) with the lowest leaf in p, so each one is seen once
+		float best = FLT_MAX;
+		for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+			if (!(p & low)) continue;
+
+			float c = cost[p] + cost[s ^ p];
+			if (c < best) { best = c; partition[s] = p; }
+		}
+		cost[s] = bbox[s].surface_area() + best;
+	}
+
+	if (cost[full] >= tree[root].cost) return;
+
+	n_internals = 0;
+	rebuild_treelet(tree, full, leaves, internals, n_internals, bbox, cost, partition);
+}
+
+// rebuild_treelet: rebuilds the subset of the treelet leaves with its optimal partition,
+// taking interior nodes from internals (the root of the treelet comes first).
+// Returns the node the subset ends up in.
+int BVH::rebuild_treelet(vector<LinearNode>& tree, int subset, int* leaves, int* internals, int& n_internals, AABB* bbox, float* cost, int* partition) {
+	if ((subset & (subset - 1)) == 0) {
+		int leaf = 0;
+		while ((1 << leaf) != subset) leaf++;
+		return leaves[leaf];
+	}
+
+	int node = internals[n_internals++];
+	int left = rebuild_treelet(tree, partition[subset], leaves, internals, n_internals, bbox, cost, partition);
+	int right = rebuild_treelet(tree, subset ^ partition[subset], leaves, internals, n_internals, bbox, cost, partition);
+
+	LinearNode& interior = tree[node];
+	interior.bbox = bbox[subset];
+	interior.cost = cost[subset];
+	interior.left = left;
+	interior.right = right;
+	interior.n_objs = tree[left].n_objs + tree[right].n_objs;
+
+	return node;
+}
+
+// emit_linear: writes the subtree of tree[node] into nodes[node_index] and its descendants at the
+// end of nodes, in the depth-first layout of build_recursive. Nothing bounds the depth of a
+// radix tree, where runs of close codes make long chains, nor of the restructured treelets, so
+// subtrees below BVH_MAX_SAH_DEPTH are emitted balanced over their leaves, as the other
+// builders split at the median there.
+void BVH::emit_linear(vector<LinearNode>& tree, int node, unsigned int node_index, int depth) {
+	LinearNode& linear_node = tree[node];
+
+	nodes[node_index].setAABB(linear_node.bbox);
+
+	if (linear_node.left < 0) nodes[node_index].makeLeaf(linear_node.first, linear_node.n_objs);
+
+	else if (depth >= BVH_MAX_SAH_DEPTH) {
+		vector<int> leaves;
+		linear_leaves(tree, node, leaves);
+		emit_balanced(tree, leaves, 0, leaves.size(), node_index);
+	}
+
+	else {
+		unsigned int left_node = nodes.size();
+
+		nodes[node_index].makeNode(left_node);
+		nodes.push_back(BVHNode());
+		nodes.push_back(BVHNode());
+
+		emit_linear(tree, linear_node.left, left_node, depth + 1);
+		emit_linear(tree, linear_node.right, left_node + 1, depth + 1);
+	}
+}
+
+// linear_leaves: appends the leaves of the subtree of tree[node] to leaves, from left to right
+void BVH::linear_leaves(vector<LinearNode>& tree, int node, vector<int>& leaves) {
+	vector<int> stack(1, node);
+
+	while (!stack.empty()) {
+		int n = stack.back();
+		stack.pop_back();
+
+		if (tree[n].left < 0) leaves.push_back(n);
+		else {
+			stack.push_back(tree[n].right);
+			stack.push_back(tree[n].left);
+		}
+	}
+}
+
+// emit_balanced: writes the leaves first to last - 1 under nodes[node_index], whose bounds are
+// set, splitting them at their median, so the subtree is about log2(last - first) levels deep
+void BVH::emit_balanced(vector<LinearNode>& tree, vector<int>& leaves, int first, int last, unsigned int node_index) {
+	if (last - first == 1) {
+		LinearNode& leaf = tree[leaves[first]];
+		nodes[node_index].makeLeaf(leaf.first, leaf.n_objs);
+		return;
+	}
+
+	int middle = (first + last) / 2;
+	AABB left_bbox = tree[leaves[first]].bbox, right_bbox = tree[leaves[middle]].bbox;
+
+	for (int i = first + 1; i < middle; i++) left_bbox.extend(tree[leaves[i]].bbox);
+	for (int i = middle + 1; i < last; i++) right_bbox.extend(tree[leaves[i]].bbox);
+
+	unsigned int left_node = nodes.size();
+
+	nodes[node_index].makeNode(left_node);
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+	nodes[left_node].setAABB(left_bbox);
+	nodes[left_node + 1].setAABB(right_bbox);
+
+	emit_balanced(tree, leaves, first, middle, left_node);
+	emit_balanced(tree, leaves, middle, last, left_node + 1);
+}
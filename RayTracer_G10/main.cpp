@@ -26,6 +26,7 @@
 #include "rayAccelerator.h"
 #include "maths.h"
 #include "macros.h"
+#include "tileScheduler.h"
 
 //Enable OpenGL drawing.  
 bool drawModeEnabled = false;
@@ -33,6 +34,7 @@ bool drawModeEnabled = false;
 bool P3F_scene = false; //choose between P3F scene or a built-in random scene
 
 #define MAX_DEPTH 6  //number of bounces
+#define TILE_SIZE 16  //tile width and height in pixels for the parallel renderer
 
 #define CAPTION "Whitted Ray-Tracer"
 #define VERTEX_COORD_ATTRIB 0
@@ -78,9 +80,11 @@ GLint UniformId;
 
 Scene* scene = NULL;
 
-Grid* grid_ptr = NULL;
-BVH* bvh_ptr = NULL;
-accelerator Accel_Struct = NONE; //NONE or GRID_ACC or BVH_ACC
+Accelerator* accel_ptr = NULL;
+accelerator Accel_Struct = NONE; //NONE or the id of a registered accelerator: GRID_ACC, BVH_ACC, LBVH_ACC, SBVH_ACC, KD_ACC
+
+PrimitiveStore scene_prims;  //without an acceleration structure every ray tests all the objects, the spheres and triangles in SSE groups
+vector<PrimRef> scene_refs;
 
 int RES_X, RES_Y;
 
@@ -92,10 +96,12 @@ bool ANTIALIASING = true;
 bool DEPTH_OF_FIELD = true;
 bool FUZZY_REFLECTIONS = false;
 bool SOFT_SHADOWS = true;
+bool ACCEL_CALIBRATION = false; // let the acceleration structure time its parameters on a coarse set of primary rays and keep the fastest (grid resolution)
+bool BVH_CACHE = true; // P3F scenes only: BVHs are saved as bvh_<key>.cache files in P3D_Scenes/ and mapped by later runs of the same geometry
 
 int SPP = 4; // Sample Per Pixel - Number of rays called for each pixel
 int NUM_LIGHTS = 4; // Should be the same as SPP
-int off_x, off_y; // Used for more even distribution using SOFT_SHADOWS + ANTIALIASING
+thread_local int off_x, off_y; // Used for more even distribution using SOFT_SHADOWS + ANTIALIASING
 float ROUGHNESS = 0.3f;
 
 /////////////////////////////////////////////////////////////////////// ERRORS
@@ -467,37 +473,12 @@ void setupGLUT(int argc, char* argv[])
 
 /////////////////////////////////////////////////////YOUR CODE HERE///////////////////////////////////////////////////////////////////////////////////////
 
-Object* getClosestObject(Ray ray, float& t) {
-	float min_dist = INFINITY;
-	Object* closest = NULL;
-
-	for (int i = 0; i < scene->getNumObjects(); i++) {
-		Object* obj = scene->getObject(i);
-		float dist = 0.0f;
-		if (obj->intercepts(ray, dist)) {
-			if (dist < min_dist) {
-				closest = obj;
-				min_dist = dist;
-			}
-		}
-	}
-	t = min_dist;
-	return closest;
+bool getClosestObject(Ray ray, HitRecord& hit) {
+	return scene_prims.intercepts(scene_refs.data(), scene_refs.size(), ray, hit);
 }
 
-bool getIntersection(Ray ray, float min_dist, bool in_shadow, float sf_length) {
-	Object* obj = NULL;
-
-	for (int i = 0; i < scene->getNumObjects(); i++) {
-		obj = scene->getObject(i);
-
-		if (obj->intercepts(ray, min_dist) && min_dist < sf_length) {
-			in_shadow = true;
-			return in_shadow;
-		}
-	}
-
-	return in_shadow;
+bool getIntersection(Ray ray, float sf_length) {
+	return scene_prims.occluded(scene_refs.data(), scene_refs.size(), ray, sf_length);
 }
 
 
@@ -506,23 +487,14 @@ Color calculateColor(Vector hit_pnt, Vector hit_norm, Light* light, Vector L, Ve
 	Color color = Color(0, 0, 0);
 	Color light_color = light->color;
 	float intensity, sf_length;
-	float min_dist = INFINITY;
 	bool in_shadow = false;
 	Vector s_ray_dir, halfway_dir;
 
-	Ray shadow_feeler = Ray(hit_pnt, L);
+	Ray shadow_feeler = Ray(hit_pnt, L.normalize());
+	sf_length = (light->position - hit_pnt).length(); //distance between light and intersection point
 
-	if (bvh_ptr != NULL) {
-		if (bvh_ptr->Traverse(shadow_feeler)) in_shadow = true;
-	}
-	else if (grid_ptr != NULL) {
-		if (grid_ptr->Traverse(shadow_feeler)) in_shadow = true;
-	}
-	else {
-		sf_length = shadow_feeler.direction.length(); //distance between light and intersection point
-		shadow_feeler.direction.normalize();
-		in_shadow = getIntersection(shadow_feeler, min_dist, in_shadow, sf_length);
-	}
+	if (accel_ptr != NULL) in_shadow = accel_ptr->Traverse(shadow_feeler, sf_length);
+	else in_shadow = getIntersection(shadow_feeler, sf_length);
 
 	if (!in_shadow) {
 		s_ray_dir = ray_dir * -1;
@@ -618,37 +590,31 @@ float schlickApproximation(float cos_d, float ior_1, float ior_2) {
 Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medium 1 where the ray is travelling
 {
 	Color color = Color(0,0,0);
-	float min_dist = INFINITY;
 	float ior_2;
-	Object* hit_obj = NULL;
+	HitRecord hit;
 	Material* mat = NULL;
 	Vector hit_pnt, exact_hit_pnt, hit_norm, light_Pos, L, v_t, refraction, reflection;
 	Light* light = NULL;
 	bool is_hit = false, r_inside = false;
 
-	//Grid is active
-	if (grid_ptr != NULL) {
-		is_hit = grid_ptr->Traverse(ray, &hit_obj, hit_pnt);
-	}
-	//BVH is active
-	else if (bvh_ptr != NULL) {
-		is_hit = bvh_ptr->Traverse(ray, &hit_obj, hit_pnt);
+	next_rand_bounce();  //every path vertex of the sample draws its own random numbers
+
+	//Acceleration structure is active
+	if (accel_ptr != NULL) {
+		is_hit = accel_ptr->Traverse(ray, hit);
 	}
 	else {
-		hit_obj = getClosestObject(ray, min_dist);
-
-		if (hit_obj != NULL) {
-			hit_pnt = ray.origin + ray.direction * min_dist;
-		}
+		is_hit = getClosestObject(ray, hit);
 	}
 
 	//If ray intercepts no object return Background or Skybox color
-	if (hit_obj == NULL && !is_hit) {
+	if (!is_hit) {
 		if (scene->GetSkyBoxFlg()) return scene->GetSkyboxColor(ray);
 		else return scene->GetBackgroundColor();
 	}
 	
-	hit_norm = hit_obj->getNormal(hit_pnt);
+	hit_pnt = ray.origin + ray.direction * hit.t;
+	hit_norm = hit.normal;
 
 	// If ray is inside the object
 	if (hit_norm * ray.direction > 0) {
@@ -658,7 +624,7 @@ Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medi
 
 	exact_hit_pnt = hit_pnt + hit_norm * SHADOW_BIAS;
 	//hit_norm = hit_norm.normalize();
-	mat = hit_obj->GetMaterial();
+	mat = hit.prim->GetMaterial();
 
 	color += calculateLightContribution(ray, exact_hit_pnt, hit_norm, mat);
 	
@@ -710,89 +676,91 @@ Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medi
 }
 
 
-// Render function by primary ray casting from the eye towards the scene's objects
+// Render the pixels of one tile. Tiles are disjoint, so every worker thread writes its own slots of img_Data, vertices and colors
 
-void renderScene()
+void renderTile(const Tile& tile)
 {
-	int index_pos = 0;
-	int index_col = 0;
-	unsigned int counter = 0;
-
-	if (drawModeEnabled) {
-		glClear(GL_COLOR_BUFFER_BIT);
-		scene->GetCamera()->SetEye(Vector(camX, camY, camZ)); //Camera motion
-	}
-
-	// Set random seed for this iteration
-	set_rand_seed(time(NULL)); 
-
-	Ray* ray = nullptr;
-
-	for (int y = 0; y < RES_Y; y++)
+	for (int y = tile.y0; y < tile.y1; y++)
 	{
-		for (int x = 0; x < RES_X; x++)
+		for (int x = tile.x0; x < tile.x1; x++)
 		{
 			Color color;
 			Vector pixel; //viewport coordinates
+			int pixel_index = y * RES_X + x;
 
 			if (!ANTIALIASING) {
+				set_rand_key(pixel_index, 0);
 				pixel.x = x + 0.5f;
 				pixel.y = y + 0.5f;
 
 				if (DEPTH_OF_FIELD) {
 					float aperture = scene->GetCamera()->GetAperture();
 					Vector lens_sample = rnd_unit_disk() * aperture;
-					ray = &scene->GetCamera()->PrimaryRay(lens_sample, pixel);
-
+					Ray ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
+					color = rayTracing(ray, 1, 1.0).clamp();
 				}
 				else {
-					ray = &scene->GetCamera()->PrimaryRay(pixel);
+					Ray ray = scene->GetCamera()->PrimaryRay(pixel);
+					color = rayTracing(ray, 1, 1.0).clamp();
 				}
-
-				color = rayTracing(*ray, 1, 1.0).clamp();
-
 			}
 			else {
 				for (int k = 0; k < SPP; k++) {
 					for (int j = 0; j < SPP; j++) {
 						off_x = k;
 						off_y = j;
+						set_rand_key(pixel_index, k * SPP + j);  //random numbers depend on the sample, not on the thread
 						pixel.x = x + (k + rand_float()) / SPP;
 						pixel.y = y + (j + rand_float()) / SPP;
 
 						if (DEPTH_OF_FIELD) {
 							float aperture = scene->GetCamera()->GetAperture();
 							Vector lens_sample = rnd_unit_disk() * aperture;
-
-							ray = &scene->GetCamera()->PrimaryRay(lens_sample, pixel);
+							Ray ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
+							color += rayTracing(ray, 1, 1.0).clamp();
 						}
 						else {
-							ray = &scene->GetCamera()->PrimaryRay(pixel);
+							Ray ray = scene->GetCamera()->PrimaryRay(pixel);
+							color += rayTracing(ray, 1, 1.0).clamp();
 						}
-
-						color += rayTracing(*ray, 1, 1.0).clamp();
 					}
 				}
 				color = color / pow(SPP, 2);
-
 			}
 
+			int counter = 3 * pixel_index;
+
 			img_Data[counter++] = u8fromfloat((float)color.r());
 			img_Data[counter++] = u8fromfloat((float)color.g());
 			img_Data[counter++] = u8fromfloat((float)color.b());
 
 			if (drawModeEnabled) {
+				int index_pos = 2 * pixel_index;
+				int index_col = 3 * pixel_index;
+
 				vertices[index_pos++] = (float)x;
 				vertices[index_pos++] = (float)y;
 				colors[index_col++] = (float)color.r();
-
 				colors[index_col++] = (float)color.g();
-
 				colors[index_col++] = (float)color.b();
 			}
 		}
+	}
+}
+
+// Render function by primary ray casting from the eye towards the scene's objects
 
+void renderScene()
+{
+	if (drawModeEnabled) {
+		glClear(GL_COLOR_BUFFER_BIT);
+		scene->GetCamera()->SetEye(Vector(camX, camY, camZ)); //Camera motion
 	}
+
+	// Tiles are spread over all cores; idle workers steal tiles from the busy ones
+	TileScheduler scheduler(RES_X, RES_Y, TILE_SIZE);
+	scheduler.Run(renderTile);
+
 	if (drawModeEnabled) {
 		drawPoints();
 		glutSwapBuffers();
@@ -887,31 +855,52 @@ void init_scene(void)
 
 	Accel_Struct = scene->GetAccelStruct();   //Type of acceleration data structure
 
-	if (Accel_Struct == GRID_ACC) {
-		grid_ptr = new Grid();
+	accel_ptr = createAccelerator(Accel_Struct);
+
+	if (accel_ptr != NULL) {
 		vector<Object*> objs;
 		int num_objects = scene->getNumObjects();
 
 		for (int o = 0; o < num_objects; o++) {
 			objs.push_back(scene->getObject(o));
 		}
-		grid_ptr->Build(objs);
-		printf("Grid built.\n\n");
-	}
-	else if (Accel_Struct == BVH_ACC) {
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
-		bvh_ptr = new BVH();
+		if (BVH_CACHE && P3F_scene) accel_ptr->setCacheDirectory(scenes_dir);  //the same geometry is built once and then loaded from the cache
 
-		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
+		auto build_start = std::chrono::high_resolution_clock::now();
+		accel_ptr->Build(objs);
+
+		if (ACCEL_CALIBRATION) {
+			Camera* cam = scene->GetCamera();
+			vector<Ray> rays;
+
+			for (int y = 0; y < 48; y++)
+				for (int x = 0; x < 64; x++)
+					rays.push_back(cam->PrimaryRay(Vector((x + 0.5f) * RES_X / 64, (y + 0.5f) * RES_Y / 48, 0)));
+			accel_ptr->Calibrate(objs, rays);
 		}
-		bvh_ptr->Build(objs);
-		printf("BVH built.\n\n");
+		double build_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - build_start).count();
+
+		AcceleratorStats stats = accel_ptr->getStats();
+		printf("%s %s in %.3f s: %d nodes, %d leaves, %d object references, %.1f MB.\n\n", getAcceleratorName(Accel_Struct),
+			accel_ptr->loadedFromCache() ? "loaded from cache" : "built", build_time,
+			(int)stats.nodes, (int)stats.leaves, (int)stats.references, stats.memory / (1024.0 * 1024.0));
 	}
-	else
+	else {
+		if (Accel_Struct != NONE) printf("Unknown acceleration data structure %d.\n", (int)Accel_Struct);
 		printf("No acceleration data structure.\n\n");
 
+		scene_prims.clear();  //nothing of a previous scene is left
+		scene_refs.clear();
+		for (int o = 0; o < scene->getNumObjects(); o++)
+			scene_refs.push_back(scene_prims.add(scene->getObject(o)));
+
+		if (scene_prims.isOverflowed()) {
+			std::cerr << "ERROR: too many primitives of one type to render without an acceleration structure." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		scene_prims.groupPrimitives(scene_refs.data(), scene_refs.size());
+	}
+
 	unsigned int spp = scene->GetSamplesPerPixel();
 	if (spp == 0)
 		printf("Whitted Ray-Tracing\n");
@@ -945,6 +934,9 @@ int main(int argc, char* argv[])
 			if (!P3F_scene) break;
 			cout << "\nPress 'y' to render another image or another key to terminate!\n";
 			delete(scene);
+			delete(accel_ptr);
+			scene_prims.clear();  //it points to the objects of the deleted scene
+			scene_refs.clear();
 			free(img_Data);
 			ch = _getch();
 		} while((toupper(ch) == 'Y')) ;
@@ -0,0 +1,80 @@
+#include "mappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(void) : data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+
+bool MappedFile::Open(const string& path) {
+	Close();
+
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) { Close(); return false; }
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) { Close(); return false; }
+
+	data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL) { Close(); return false; }
+
+	size = (size_t)file_size.QuadPart;
+	return true;
+}
+
+void MappedFile::Close(void) {
+	if (data != NULL) UnmapViewOfFile(data);
+	if (mapping != NULL) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+
+	data = NULL;
+	size = 0;
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile(void) : data(NULL), size(0), file(-1) {}
+
+bool MappedFile::Open(const string& path) {
+	Close();
+
+	file = open(path.c_str(), O_RDONLY);
+	if (file < 0) return false;
+
+	struct stat st;
+	if (fstat(file, &st) != 0 || st.st_size == 0) { Close(); return false; }
+
+	void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, file, 0);
+	if (p == MAP_FAILED) { Close(); return false; }
+
+	data = (const char*)p;
+	size = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::Close(void) {
+	if (data != NULL) munmap((void*)data, size);
+	if (file >= 0) close(file);
+
+	data = NULL;
+	size = 0;
+	file = -1;
+}
+
+#endif
+
+MappedFile::~MappedFile(void) { Close(); }
@@ -0,0 +1,38 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// Read-only memory mapping of a whole file. The pages are loaded by the OS on first
+// access and shared with the file cache, so a mapped file is usable right after Open.
+
+class MappedFile
+{
+public:
+	MappedFile(void);
+	~MappedFile(void);
+
+	bool Open(const string& path);
+	void Close(void);
+
+	const char* getData(void) { return data; }
+	size_t getSize(void) { return size; }
+
+private:
+	MappedFile(const MappedFile&);				// not copyable: the destructor unmaps
+	MappedFile& operator=(const MappedFile&);
+
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	void* file;		// HANDLE
+	void* mapping;	// HANDLE
+#else
+	int file;
+#endif
+};
+
+#endif
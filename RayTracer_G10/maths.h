@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include "vector.h"
+#include "sampler.h"
 
 #define PI				3.141592653589793238462f
 
@@ -19,6 +20,9 @@ double rand_double(double min, double max);
 Vector rnd_unit_disk(void);
 Vector rnd_unit_sphere(void);
 void set_rand_seed(const int seed);
+void set_rand_key(unsigned int pixel, unsigned int sample);
+void next_rand_bounce(void);
+Sampler& thread_sampler(void);
 uint8_t u8fromfloat(float x);
 float u8tofloat(uint8_t x);
 
@@ -53,12 +57,21 @@ clamp(const double x, const double min, const double max) {
 }
 
 
+// ---------------------------------------------------- thread_sampler
+// each thread draws from its own generator, so sampling never contends on a shared state
+
+inline Sampler&
+thread_sampler(void) {
+	static thread_local Sampler sampler;
+	return sampler;
+}
+
+
 // ---------------------------------------------------- rand_int
-// a wrapper for rand()
 
 inline int
 rand_int(void) {
-	return(rand());
+	return((int)(thread_sampler().NextUInt() >> 1));
 }
 
 
@@ -66,7 +79,7 @@ rand_int(void) {
 
 inline float
 rand_float(void) {
-	return((float)rand() / ((float)RAND_MAX+1.0));
+	return(thread_sampler().NextFloat());
 }
 
 
@@ -74,7 +87,7 @@ rand_float(void) {
 
 inline double
 rand_double(void) {
-	return((double)rand() / ((double)RAND_MAX + 1.0));
+	return(thread_sampler().NextDouble());
 }
 
 // ---------------------------------------------------- rand_double(min, max)
@@ -106,7 +119,21 @@ inline Vector rnd_unit_sphere(void) {
 // ---------------------------------------------------- set_rand_seed
 inline void
 set_rand_seed(const int seed) {
-	srand(seed);
+	thread_sampler().Seed((uint64_t)(unsigned int)seed, 0xda3e39cb94b95bdbULL);
+}
+
+// ---------------------------------------------------- set_rand_key
+// restart this thread's sampler at the numbers of a given pixel and sample index
+inline void
+set_rand_key(unsigned int pixel, unsigned int sample) {
+	thread_sampler().Key(pixel, sample, 0);
+}
+
+// ---------------------------------------------------- next_rand_bounce
+// move this thread's sampler to the numbers of the next path vertex of the current sample
+inline void
+next_rand_bounce(void) {
+	thread_sampler().NextBounce();
 }
 
 // ---------------------------------------------------- float to byte (unsigned char)
@@ -0,0 +1,38 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <thread>
+#include <functional>
+
+using namespace std;
+
+// ---------------------------------------------------- num_threads
+inline int num_threads(void) {
+	int n = thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+// ---------------------------------------------------- parallel_for
+// Splits [begin, end[ in n_chunks contiguous slices and calls fn(chunk, first, last) for each
+// one on its own thread (the calling thread takes chunk 0). Slices are always the same for the
+// same arguments, so per-chunk results can be merged in chunk order deterministically.
+
+inline void parallel_for(int begin, int end, int n_chunks, const function<void(int, int, int)>& fn) {
+	if (n_chunks < 1) n_chunks = 1;
+	if (n_chunks > end - begin) n_chunks = end - begin > 0 ? end - begin : 1;
+
+	vector<thread> workers;
+	for (int c = 1; c < n_chunks; c++) {
+		int first = begin + (int)((long long)(end - begin) * c / n_chunks);
+		int last = begin + (int)((long long)(end - begin) * (c + 1) / n_chunks);
+		workers.push_back(thread(fn, c, first, last));
+	}
+
+	fn(0, begin, begin + (int)((long long)(end - begin) / n_chunks));
+
+	for (auto& t : workers)
+		t.join();
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include "primitives.h"
+
+void PrimitiveStore::clear(void) {
+	spheres = Spheres();
+	triangles = Triangles();
+	boxes = Boxes();
+	objects.clear();
+	objects.shrink_to_fit();
+	overflowed = false;
+}
+
+PrimRef PrimitiveStore::addSphere(Object* obj, const Vector& center, float radius) {
+	spheres.x.push_back(center.x);
+	spheres.y.push_back(center.y);
+	spheres.z.push_back(center.z);
+	spheres.sq_radius.push_back(radius * radius);
+	spheres.obj.push_back(obj);
+	return last_ref(PRIM_SPHERE, spheres.obj.size());
+}
+
+PrimRef PrimitiveStore::addTriangle(Object* obj, const Vector& p0, const Vector& edge1, const Vector& edge2) {
+	triangles.p0x.push_back(p0.x);
+	triangles.p0y.push_back(p0.y);
+	triangles.p0z.push_back(p0.z);
+	triangles.e1x.push_back(edge1.x);
+	triangles.e1y.push_back(edge1.y);
+	triangles.e1z.push_back(edge1.z);
+	triangles.e2x.push_back(edge2.x);
+	triangles.e2y.push_back(edge2.y);
+	triangles.e2z.push_back(edge2.z);
+	triangles.obj.push_back(obj);
+	return last_ref(PRIM_TRIANGLE, triangles.obj.size());
+}
+
+PrimRef PrimitiveStore::addBox(Object* obj, const Vector& min, const Vector& max) {
+	boxes.min_x.push_back(min.x);
+	boxes.min_y.push_back(min.y);
+	boxes.min_z.push_back(min.z);
+	boxes.max_x.push_back(max.x);
+	boxes.max_y.push_back(max.y);
+	boxes.max_z.push_back(max.z);
+	boxes.obj.push_back(obj);
+	return last_ref(PRIM_BOX, boxes.obj.size());
+}
+
+PrimRef PrimitiveStore::addObject(Object* obj) {
+	objects.push_back(obj);
+	return last_ref(PRIM_OBJECT, objects.size());
+}
+
+// The primitives of a group are consecutive in the arrays, and the SSE tests always load
+// PRIM_GROUP_SIZE of them, so the arrays get zeros past the last one.
+void PrimitiveStore::groupPrimitives(PrimRef* refs, unsigned int n) {
+	size_t padded = triangles.obj.size() + PRIM_GROUP_SIZE - 1;
+
+	if (triangles.p0x.size() < padded) {
+		for (vector<float>* component : { &triangles.p0x, &triangles.p0y, &triangles.p0z, &triangles.e1x, &triangles.e1y,
+			&triangles.e1z, &triangles.e2x, &triangles.e2y, &triangles.e2z })
+			component->resize(padded, 0.0f);
+	}
+
+	padded = spheres.obj.size() + PRIM_GROUP_SIZE - 1;
+
+	if (spheres.x.size() < padded) {
+		for (vector<float>* component : { &spheres.x, &spheres.y, &spheres.z, &spheres.sq_radius })
+			component->resize(padded, 0.0f);
+	}
+
+	for (unsigned int k = 0; k < n; ) {
+		PrimType type = refs[k].getType();
+		unsigned int count = 1;
+
+		if (type == PRIM_TRIANGLE || type == PRIM_SPHERE) {
+			while (k + count < n && count < PRIM_GROUP_SIZE && refs[k + count].getType() == type &&
+				refs[k + count].getIndex() == refs[k].getIndex() + count) count++;
+		}
+
+		refs[k].setCount(count);
+		k += count;
+	}
+}
+
+size_t PrimitiveStore::getMemory(void) {
+	return spheres.obj.size() * (4 * sizeof(float) + sizeof(Object*)) +
+		triangles.obj.size() * (9 * sizeof(float) + sizeof(Object*)) +
+		boxes.obj.size() * (6 * sizeof(float) + sizeof(Object*)) +
+		objects.size() * sizeof(Object*);
+}
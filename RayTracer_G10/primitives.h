@@ -0,0 +1,406 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+#include <cassert>
+#include <emmintrin.h>
+#include "scene.h"
+#include "macros.h"
+
+using namespace std;
+
+#define PRIM_GROUP_SIZE 4  // triangles or spheres of a leaf tested at once, one per SSE lane
+#define PRIM_INDEX_BITS 28  // PrimRef index width: a store holds up to 2^28 primitives of each type
+
+// ------------------------------------------------------------------ intersection kernels
+// Shared by the primitive store and the Object classes, so both give the same hits.
+
+// Moller-Trumbore: solves origin + t * direction = P0 + u * edge1 + v * edge2 by Cramer's rule,
+// where all three determinants share the denominator det = edge1 . (direction x edge2).
+// Each barycentric is checked as soon as it is known, so most misses end after u.
+// The arithmetic is written out on the components, as it runs for every leaf object.
+inline bool intersect_triangle(float p0x, float p0y, float p0z, float e1x, float e1y, float e1z, float e2x, float e2y, float e2z,
+	const Ray& r, float& t, float& u, float& v) {
+	const Vector& d = r.direction;
+
+	// p = direction x edge2
+	float px = d.y * e2z - d.z * e2y;
+	float py = d.z * e2x - d.x * e2z;
+	float pz = d.x * e2y - d.y * e2x;
+
+	float det = e1x * px + e1y * py + e1z * pz;
+	if (det == 0.0f) return false;  // ray parallel to the triangle
+	float inv_det = 1.0f / det;
+
+	float sx = r.origin.x - p0x, sy = r.origin.y - p0y, sz = r.origin.z - p0z;
+
+	u = (sx * px + sy * py + sz * pz) * inv_det;
+	if (u < 0.0f || u > 1.0f) return false;
+
+	// q = s x edge1
+	float qx = sy * e1z - sz * e1y;
+	float qy = sz * e1x - sx * e1z;
+	float qz = sx * e1y - sy * e1x;
+
+	v = (d.x * qx + d.y * qy + d.z * qz) * inv_det;
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+	return t >= 0.0f;
+}
+
+// Nearest root of |origin + t * direction - center|^2 = radius^2 in front of the origin: the far
+// one when the origin is inside the sphere
+inline bool intersect_sphere(float cx, float cy, float cz, float sq_radius, const Ray& r, float& t) {
+	float ocx = cx - r.origin.x, ocy = cy - r.origin.y, ocz = cz - r.origin.z;
+	float b = r.direction.x * ocx + r.direction.y * ocy + r.direction.z * ocz;
+	float c = ocx * ocx + ocy * ocy + ocz * ocz - sq_radius;
+	double discr = (double)b * b - c;  // in double: grazing rays cancel most digits of both terms
+
+	if (discr <= 0.0) return false;
+
+	if (c > 0.0f) {
+		if (b <= 0.0f) return false;
+
+		t = (float)(b - sqrt(discr));
+	}
+
+	else t = (float)(b + sqrt(discr));
+
+	return true;
+}
+
+// Slab test of an axis aligned box. face: axis of the face the ray crosses at t, + 3 on the
+// faces of max. The ray enters through the face of min where the direction is positive and
+// leaves through the one of max.
+inline bool intersect_box(float min_x, float min_y, float min_z, float max_x, float max_y, float max_z, const Ray& ray, float& t, int& face) {
+	double tx_min, ty_min, tz_min;
+	double tx_max, ty_max, tz_max;
+	double a = 1.0 / ray.direction.x;
+	double b = 1.0 / ray.direction.y;
+	double c = 1.0 / ray.direction.z;
+	float tE, tL;
+
+	if (a >= 0) {
+		tx_min = (min_x - ray.origin.x) * a;
+		tx_max = (max_x - ray.origin.x) * a;
+	}
+	else {
+		tx_min = (max_x - ray.origin.x) * a;
+		tx_max = (min_x - ray.origin.x) * a;
+	}
+
+	if (b >= 0) {
+		ty_min = (min_y - ray.origin.y) * b;
+		ty_max = (max_y - ray.origin.y) * b;
+	}
+	else {
+		ty_min = (max_y - ray.origin.y) * b;
+		ty_max = (min_y - ray.origin.y) * b;
+	}
+
+	if (c >= 0) {
+		tz_min = (min_z - ray.origin.z) * c;
+		tz_max = (max_z - ray.origin.z) * c;
+	}
+	else {
+		tz_min = (max_z - ray.origin.z) * c;
+		tz_max = (min_z - ray.origin.z) * c;
+	}
+
+	//largest entering t value
+	tE = MAX3(tx_min, ty_min, tz_min);
+
+	//smallest exiting t value
+	tL = MIN3(tx_max, ty_max, tz_max);
+
+	if (tE < tL && tL > 0) {
+		if (tE > 0) {
+			t = tE;
+			if (tE == (float)tx_min) face = a >= 0 ? 0 : 3;
+			else if (tE == (float)ty_min) face = b >= 0 ? 1 : 4;
+			else face = c >= 0 ? 2 : 5;
+		}
+		else {
+			t = tL;
+			if (tL == (float)tx_max) face = a >= 0 ? 3 : 0;
+			else if (tL == (float)ty_max) face = b >= 0 ? 4 : 1;
+			else face = c >= 0 ? 5 : 2;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+// ------------------------------------------------------------------ primitive store
+
+enum PrimType { PRIM_SPHERE, PRIM_TRIANGLE, PRIM_BOX, PRIM_OBJECT };  // PRIM_OBJECT: any other object, tested through its virtual methods
+
+// Reference to a primitive of a PrimitiveStore: its type and its index in the arrays of the type.
+// A reference to a group of triangles or spheres also covers the getCount() - 1 references that
+// follow it, to the next primitives of the arrays, which the tests of a range of references skip.
+struct PrimRef {
+	uint32_t bits;  // bits 30-31: type, bits 28-29: count - 1, bits 0-27: index
+
+	PrimRef(void) : bits(0) {}
+	PrimRef(PrimType type, uint32_t index) : bits(((uint32_t)type << 30) | index) { assert(index < (1u << PRIM_INDEX_BITS)); }
+	PrimType getType() const { return (PrimType)(bits >> 30); }
+	uint32_t getIndex() const { return bits & ((1u << PRIM_INDEX_BITS) - 1); }
+	unsigned int getCount() const { return ((bits >> 28) & 3) + 1; }
+	void setCount(unsigned int count) { bits = (bits & ~(3u << 28)) | ((count - 1) << 28); }
+};
+
+// The primitives an acceleration structure traverses, copied out of the scene objects into an
+// array per component for each type, in the order the structure references them: leaf tests
+// read consecutive floats and dispatch on the type of the reference instead of through two
+// virtual calls on objects scattered over the heap. The objects are only kept to report what
+// was hit, and to test the ones of other types.
+class PrimitiveStore
+{
+public:
+	void clear(void);
+	PrimRef add(Object* obj) { return obj->storeIn(*this); }
+	PrimRef addSphere(Object* obj, const Vector& center, float radius);
+	PrimRef addTriangle(Object* obj, const Vector& p0, const Vector& edge1, const Vector& edge2);
+	PrimRef addBox(Object* obj, const Vector& min, const Vector& max);
+	PrimRef addObject(Object* obj);
+	void groupPrimitives(PrimRef* refs, unsigned int n);  // groups the runs of consecutive triangles or spheres of refs, once all are added
+	size_t getMemory(void);  // bytes of the arrays
+	bool isOverflowed(void) { return overflowed; }  // a type got more primitives than PrimRef can index: the refs are not valid
+
+	bool intercepts(PrimRef ref, Ray& ray, float& t);  // any hit, at t
+	bool intercepts(PrimRef ref, Ray& ray, HitRecord& hit);  // fills hit with a hit closer than hit.t
+	bool intercepts(const PrimRef* refs, unsigned int n, Ray& ray, HitRecord& hit);  // the closest hit of n references
+	bool occluded(const PrimRef* refs, unsigned int n, Ray& ray, float length);  // any hit closer than length
+
+private:
+	PrimRef last_ref(PrimType type, size_t n);  // reference to the last of the n primitives of type
+	int intercepts_group(PrimRef ref, Ray& ray, float t_max, float* t, float* u, float* v);  // mask of the triangles hit closer than t_max
+	int intercepts_sphere_group(PrimRef ref, Ray& ray, float t_max, float* t);  // mask of the spheres hit closer than t_max
+	void set_sphere_hit(uint32_t i, Ray& ray, float t, HitRecord& hit);
+	void set_triangle_hit(uint32_t i, float t, float u, float v, HitRecord& hit);
+
+	struct Spheres {
+		vector<float> x, y, z, sq_radius;
+		vector<Object*> obj;
+	} spheres;
+
+	struct Triangles {
+		vector<float> p0x, p0y, p0z, e1x, e1y, e1z, e2x, e2y, e2z;
+		vector<Object*> obj;
+	} triangles;
+
+	struct Boxes {
+		vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+		vector<Object*> obj;
+	} boxes;
+
+	vector<Object*> objects;
+	bool overflowed = false;
+};
+
+// The index of a PrimRef has PRIM_INDEX_BITS bits: past them the store is marked overflowed and
+// the reference is to the first primitive, so a wrong index never spills into the type bits
+// even in builds without asserts. The owner of the store checks isOverflowed once it is filled.
+inline PrimRef PrimitiveStore::last_ref(PrimType type, size_t n) {
+	if (n > (1u << PRIM_INDEX_BITS)) {
+		overflowed = true;
+		return PrimRef(type, 0);
+	}
+	return PrimRef(type, n - 1);
+}
+
+inline bool PrimitiveStore::intercepts(PrimRef ref, Ray& ray, float& t) {
+	uint32_t i = ref.getIndex();
+	float u, v;
+	int face;
+
+	switch (ref.getType()) {
+	case PRIM_SPHERE:
+		return intersect_sphere(spheres.x[i], spheres.y[i], spheres.z[i], spheres.sq_radius[i], ray, t);
+	case PRIM_TRIANGLE:
+		return intersect_triangle(triangles.p0x[i], triangles.p0y[i], triangles.p0z[i], triangles.e1x[i], triangles.e1y[i], triangles.e1z[i],
+			triangles.e2x[i], triangles.e2y[i], triangles.e2z[i], ray, t, u, v);
+	case PRIM_BOX:
+		return intersect_box(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i], boxes.max_x[i], boxes.max_y[i], boxes.max_z[i], ray, t, face);
+	default:
+		return objects[i]->intercepts(ray, t);
+	}
+}
+
+// the normals are only computed for the hits closer than the previous ones
+inline bool PrimitiveStore::intercepts(PrimRef ref, Ray& ray, HitRecord& hit) {
+	uint32_t i = ref.getIndex();
+	float t, u, v;
+	int face;
+
+	switch (ref.getType()) {
+	case PRIM_SPHERE: {
+		if (!intersect_sphere(spheres.x[i], spheres.y[i], spheres.z[i], spheres.sq_radius[i], ray, t) || t >= hit.t) return false;
+
+		set_sphere_hit(i, ray, t, hit);
+		return true;
+	}
+	case PRIM_TRIANGLE: {
+		if (!intersect_triangle(triangles.p0x[i], triangles.p0y[i], triangles.p0z[i], triangles.e1x[i], triangles.e1y[i], triangles.e1z[i],
+			triangles.e2x[i], triangles.e2y[i], triangles.e2z[i], ray, t, u, v) || t >= hit.t) return false;
+
+		set_triangle_hit(i, t, u, v, hit);
+		return true;
+	}
+	case PRIM_BOX: {
+		if (!intersect_box(boxes.min_x[i], boxes.min_y[i], boxes.min_z[i], boxes.max_x[i], boxes.max_y[i], boxes.max_z[i], ray, t, face) || t >= hit.t) return false;
+
+		Vector normal = Vector(0, 0, 0);  // outward normal of the face
+		normal.setAxisValue(face % 3, face < 3 ? -1.0f : 1.0f);
+		hit.set(t, boxes.obj[i], normal);
+		return true;
+	}
+	default:
+		return objects[i]->intercepts(ray, hit);
+	}
+}
+
+inline void PrimitiveStore::set_sphere_hit(uint32_t i, Ray& ray, float t, HitRecord& hit) {
+	Vector normal = Vector(ray.origin.x + ray.direction.x * t - spheres.x[i], ray.origin.y + ray.direction.y * t - spheres.y[i], ray.origin.z + ray.direction.z * t - spheres.z[i]);
+
+	hit.set(t, spheres.obj[i], normal.normalize());
+}
+
+inline void PrimitiveStore::set_triangle_hit(uint32_t i, float t, float u, float v, HitRecord& hit) {
+	Vector edge1 = Vector(triangles.e1x[i], triangles.e1y[i], triangles.e1z[i]);
+	Vector normal = edge1 % Vector(triangles.e2x[i], triangles.e2y[i], triangles.e2z[i]);
+
+	hit.set(t, triangles.obj[i], normal.normalize(), u, v);
+}
+
+// Moller-Trumbore as in intersect_triangle, with the same operations in every lane on the
+// triangles ref.getIndex() to ref.getIndex() + PRIM_GROUP_SIZE - 1 of the arrays, which are
+// padded for the last group. The lanes from ref.getCount() on belong to other references.
+inline int PrimitiveStore::intercepts_group(PrimRef ref, Ray& ray, float t_max, float* t_out, float* u_out, float* v_out) {
+	uint32_t i = ref.getIndex();
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+	__m128 e1x = _mm_loadu_ps(&triangles.e1x[i]), e1y = _mm_loadu_ps(&triangles.e1y[i]), e1z = _mm_loadu_ps(&triangles.e1z[i]);
+	__m128 e2x = _mm_loadu_ps(&triangles.e2x[i]), e2y = _mm_loadu_ps(&triangles.e2y[i]), e2z = _mm_loadu_ps(&triangles.e2z[i]);
+
+	// p = direction x edge2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 valid = _mm_cmpneq_ps(det, zero);
+	__m128 inv_det = _mm_div_ps(one, det);
+
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&triangles.p0x[i]));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&triangles.p0y[i]));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&triangles.p0z[i]));
+
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+	if (!(_mm_movemask_ps(valid) & ((1 << ref.getCount()) - 1))) return 0;  // most groups are missed by all lanes
+
+	// q = s x edge1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, _mm_set1_ps(t_max))));
+
+	_mm_storeu_ps(t_out, t);
+	_mm_storeu_ps(u_out, u);
+	_mm_storeu_ps(v_out, v);
+	return _mm_movemask_ps(valid) & ((1 << ref.getCount()) - 1);
+}
+
+// intersect_sphere in every lane on the spheres ref.getIndex() to ref.getIndex() + PRIM_GROUP_SIZE - 1.
+// b and c are single precision as there, and the discriminant and the roots are taken in double
+// two lanes at a time, so the group finds the same hits as the spheres one by one.
+inline int PrimitiveStore::intercepts_sphere_group(PrimRef ref, Ray& ray, float t_max, float* t_out) {
+	uint32_t i = ref.getIndex();
+	int lanes = (1 << ref.getCount()) - 1;
+	__m128 zero = _mm_setzero_ps();
+	__m128d zero_d = _mm_setzero_pd();
+
+	__m128 ocx = _mm_sub_ps(_mm_loadu_ps(&spheres.x[i]), _mm_set1_ps(ray.origin.x));
+	__m128 ocy = _mm_sub_ps(_mm_loadu_ps(&spheres.y[i]), _mm_set1_ps(ray.origin.y));
+	__m128 ocz = _mm_sub_ps(_mm_loadu_ps(&spheres.z[i]), _mm_set1_ps(ray.origin.z));
+
+	__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ray.direction.x), ocx), _mm_mul_ps(_mm_set1_ps(ray.direction.y), ocy)),
+		_mm_mul_ps(_mm_set1_ps(ray.direction.z), ocz));
+	__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&spheres.sq_radius[i]));
+
+	__m128d b_lo = _mm_cvtps_pd(b), b_hi = _mm_cvtps_pd(_mm_movehl_ps(b, b));
+	__m128d c_lo = _mm_cvtps_pd(c), c_hi = _mm_cvtps_pd(_mm_movehl_ps(c, c));
+	__m128d discr_lo = _mm_sub_pd(_mm_mul_pd(b_lo, b_lo), c_lo), discr_hi = _mm_sub_pd(_mm_mul_pd(b_hi, b_hi), c_hi);
+
+	int mask = (_mm_movemask_pd(_mm_cmpgt_pd(discr_lo, zero_d)) | (_mm_movemask_pd(_mm_cmpgt_pd(discr_hi, zero_d)) << 2)) & lanes;
+	if (mask == 0) return 0;  // most groups are missed by all lanes
+
+	// the near root outside the sphere, the far one inside
+	__m128d sqrt_lo = _mm_sqrt_pd(discr_lo), sqrt_hi = _mm_sqrt_pd(discr_hi);
+	__m128d outside_lo = _mm_cmpgt_pd(c_lo, zero_d), outside_hi = _mm_cmpgt_pd(c_hi, zero_d);
+	__m128d t_lo = _mm_or_pd(_mm_and_pd(outside_lo, _mm_sub_pd(b_lo, sqrt_lo)), _mm_andnot_pd(outside_lo, _mm_add_pd(b_lo, sqrt_lo)));
+	__m128d t_hi = _mm_or_pd(_mm_and_pd(outside_hi, _mm_sub_pd(b_hi, sqrt_hi)), _mm_andnot_pd(outside_hi, _mm_add_pd(b_hi, sqrt_hi)));
+	__m128 t = _mm_movelh_ps(_mm_cvtpd_ps(t_lo), _mm_cvtpd_ps(t_hi));
+
+	// outside the sphere and moving away from its center: no hit in front of the origin
+	__m128 behind = _mm_and_ps(_mm_cmpgt_ps(c, zero), _mm_cmple_ps(b, zero));
+	mask &= ~_mm_movemask_ps(_mm_or_ps(behind, _mm_cmpnlt_ps(t, _mm_set1_ps(t_max))));
+
+	_mm_storeu_ps(t_out, t);
+	return mask;
+}
+
+// Groups of triangles or spheres keep the nearest of their hits, the first one on ties as the scalar tests do
+inline bool PrimitiveStore::intercepts(const PrimRef* refs, unsigned int n, Ray& ray, HitRecord& hit) {
+	float t[PRIM_GROUP_SIZE], u[PRIM_GROUP_SIZE], v[PRIM_GROUP_SIZE];
+	bool is_hit = false;
+
+	for (unsigned int k = 0; k < n; k += refs[k].getCount()) {
+		if (refs[k].getCount() == 1) {
+			if (intercepts(refs[k], ray, hit)) is_hit = true;
+			continue;
+		}
+
+		bool sphere = refs[k].getType() == PRIM_SPHERE;
+		int mask = sphere ? intercepts_sphere_group(refs[k], ray, hit.t, t) : intercepts_group(refs[k], ray, hit.t, t, u, v);
+		if (mask == 0) continue;
+
+		int nearest = -1;
+		for (int lane = 0; lane < PRIM_GROUP_SIZE; lane++)
+			if ((mask & (1 << lane)) && (nearest < 0 || t[lane] < t[nearest])) nearest = lane;
+
+		if (sphere) set_sphere_hit(refs[k].getIndex() + nearest, ray, t[nearest], hit);
+		else set_triangle_hit(refs[k].getIndex() + nearest, t[nearest], u[nearest], v[nearest], hit);
+		is_hit = true;
+	}
+
+	return is_hit;
+}
+
+inline bool PrimitiveStore::occluded(const PrimRef* refs, unsigned int n, Ray& ray, float length) {
+	float t[PRIM_GROUP_SIZE], u[PRIM_GROUP_SIZE], v[PRIM_GROUP_SIZE];
+
+	for (unsigned int k = 0; k < n; k += refs[k].getCount()) {
+		if (refs[k].getCount() == 1) {
+			if (intercepts(refs[k], ray, t[0]) && t[0] < length) return true;
+		}
+		else if (refs[k].getType() == PRIM_SPHERE) {
+			if (intercepts_sphere_group(refs[k], ray, length, t)) return true;
+		}
+		else if (intercepts_group(refs[k], ray, length, t, u, v)) return true;
+	}
+
+	return false;
+}
+
+#endif
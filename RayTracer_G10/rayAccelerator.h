@@ -1,14 +1,107 @@
 #ifndef ACCELERATOR_H
 #define ACCELERATOR_H
 
-#include <stack>
 #include <queue>
+#include <algorithm>
 #include <cmath>
+#include <stdint.h>
 #include "scene.h"
+#include "primitives.h"
+#include "alignedAllocator.h"
+#include "mappedFile.h"
+#include <xmmintrin.h>
 
 using namespace std;
 
-class Grid
+#define ACCEL_PARALLEL_BOUNDS 4096  // the bounds of fewer objects are computed by a single thread
+
+#define BVH_STACK_SIZE 64  // capacity of the per-call BVH traversal stack (deeper than any tree we build)
+#define BVH_MAX_SAH_DEPTH 32  // below this depth nodes are split at the median (the linear builder balances its subtrees over their leaves), so trees of fewer than 2^31 objects stay shallower than BVH_STACK_SIZE
+#define BVH_SAH_BINS 16  // number of bins per axis of the binned SAH builder
+#define BVH_PARALLEL_SUBTREE 4096  // smaller subtrees are built by a single thread
+#define BVH_PARALLEL_BINNING 32768  // smaller ranges are binned by a single thread
+#define BVH_LBVH_WIDE_CODES 65536  // from this many objects up the linear builder uses 63-bit Morton codes instead of 30-bit
+#define BVH_TREELET_LEAVES 5  // leaves of the treelets restructured after a linear build
+#define BVH_SBVH_BINS 32  // spatial split candidates per axis
+#define BVH_SBVH_ALPHA 1e-5f  // spatial splits are tried where the children of the object split overlap by this fraction of the root area
+#define BVH_WIDTH 4  // children per node of the collapsed BVH, one per SSE lane
+#define BVH_CACHE_VERSION 2  // bump when the layout of the nodes or of the builders changes
+
+// builders, as recorded in the cache key
+#define BVH_BUILDER_SAH 0
+#define BVH_BUILDER_LINEAR 1
+#define BVH_BUILDER_LINEAR_TREELETS 2
+#define BVH_BUILDER_SPATIAL 3
+#define BVH_WIDE_STACK_SIZE ((BVH_WIDTH - 1) * BVH_STACK_SIZE + 1)  // every wide node visited pushes at most BVH_WIDTH - 1 extra entries
+
+#define GRID_SUB_THRESHOLD 16	// cells with more objects than this get a sub-grid
+#define GRID_MAX_DEPTH 2		// levels of sub-grids below the top grid
+#define GRID_DENSITIES 0.5f, 0.75f, 1.0f, 1.5f, 2.0f, 3.0f, 4.0f	// candidate cells per object along each axis
+#define GRID_COST_STEP 1.0f			// cost model: cost of stepping into a cell...
+#define GRID_COST_INTERSECT 3.0f	// ...and of intersecting an object
+#define GRID_MAX_CELLS_PER_OBJECT 64	// resolutions are scaled down so levels have at most this many cells per object
+#define GRID_OVERLAP_MARGIN 1e-3f	// cells are enlarged by this fraction of their size for the object overlap tests
+#define GRID_PARALLEL_OBJECTS 4096	// levels with fewer objects are filled by a single thread
+
+#define KD_COST_TRAVERSAL 1.0f	// SAH of the kd-tree: cost of a traversal step...
+#define KD_COST_INTERSECT 20.0f	// ...and of an object intersection
+#define KD_EMPTY_BONUS 0.5f		// fraction of the cost saved by splits that cut off empty space
+#define KD_MAX_DEPTH 60			// below the stack size of the traversal
+#define KD_STACK_SIZE 64
+
+// sizes of a built acceleration structure, to compare the backends
+struct AcceleratorStats {
+	size_t nodes;		// tree nodes or grid cells
+	size_t leaves;		// leaves or non-empty cells
+	size_t references;	// object references in the leaves or cells (objects may be referenced several times)
+	size_t memory;		// bytes of the structure, not counting the objects
+};
+
+// Interface of the acceleration structures: the renderer only traces rays through it, so any 
+// backend registered with registerAccelerator can be selected by its id with the p3f accel command.
+class Accelerator
+{
+public:
+	virtual ~Accelerator() {}
+	virtual int getNumObjects() = 0;
+	virtual void Build(vector<Object*>& objs) = 0;
+	virtual bool Traverse(Ray& ray, HitRecord& hit) = 0;  // closest hit, if closer than hit.t
+	virtual bool Traverse(const Ray& ray, float t_max) = 0;  // any hit closer than t_max, for a unit ray.direction
+	virtual AcceleratorStats getStats() = 0;
+	virtual void setCacheDirectory(const string& /*dir*/) {}  // only for the backends that can save what they build
+	virtual bool loadedFromCache() { return false; }  // by the last Build, instead of building
+	virtual void Calibrate(vector<Object*>& /*objs*/, vector<Ray>& /*rays*/) {}  // only for the backends with parameters to tune: rebuilds with the ones that trace rays fastest
+
+protected:
+	// Objects without bounds, such as planes, are kept out of the structure and tested by every ray
+	vector<Object*> unbounded;
+
+	void split_unbounded(vector<Object*>& objs, vector<Object*>& bounded);  // fills unbounded and bounded
+	void intercepts_unbounded(Ray& ray, HitRecord& hit);  // records the nearest hit closer than hit.t
+	bool intercepts_unbounded(Ray& ray, float length);  // any hit closer than length
+
+	// Primitive data of the bounded objects, which the traversals test instead of the objects:
+	// refs[i] is the primitive of the object of index i in the structure
+	PrimitiveStore prims;
+	vector<PrimRef> refs;
+
+	bool store_primitives(vector<Object*>& objs);  // fills prims and refs in the order of objs; false if they do not fit
+
+	// Bounds of the bounded objects, in the order of refs, computed once per Build: the builders
+	// read this array instead of calling GetBoundingBox for every level, cell or split candidate
+	vector<AABB> bounds;
+
+	AABB store_bounds(vector<Object*>& objs);  // fills bounds in the order of objs, returns their union
+	void free_bounds(void);  // once the structure is built
+};
+
+typedef Accelerator* (*AcceleratorFactory)(void);
+
+bool registerAccelerator(int id, const char* name, AcceleratorFactory factory);  // false if id is taken
+Accelerator* createAccelerator(int id);  // NULL if no backend has that id
+const char* getAcceleratorName(int id);
+
+class Grid : public Accelerator
 {
 public:
 	Grid(void);
@@ -18,80 +111,243 @@ public:
 	void setAABB(AABB& bbox_);
 	Object* getObject(unsigned int index);
 	void Build(vector<Object*>& objs);   // set up grid cells
-	bool Traverse(Ray& ray, Object **hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
-	bool Traverse(Ray& ray);  //Traverse for shadow ray
+	bool Traverse(Ray& ray, HitRecord& hit);
+	bool Traverse(const Ray& ray, float t_max);  //Traverse for shadow ray
+	AcceleratorStats getStats();
+
+	void setDensity(float m_) { m = m_; }  // 0: chosen by the cost model
+	void Calibrate(vector<Object*>& objs, vector<Ray>& rays);  // rebuilds with the density that traces rays fastest
 
 private:
+	// a uniform grid: the top one or the sub-grid of a dense cell, which spans exactly that cell
+	struct GridLevel {
+		AABB bbox;
+		int nx, ny, nz;				// number of cells in the x, y, and z directions
+		unsigned int first_cell;	// index of its cell (0, 0, 0) in cell_offsets
+		int depth;					// 0 for the top grid
+		float density;				// about density cells per object along each axis
+	};
+
+	enum WalkResult { WALK_MISSED, WALK_EXITED, WALK_DONE };
+
 	vector<Object *> objects;
-	vector<vector<Object*> > cells;
+
+	// cells of all levels in compressed sparse row form: the objects of cell c are 
+	// objects[cell_prims[i]] for cell_offsets[c] <= i < cell_offsets[c + 1]
+	vector<unsigned int> cell_offsets;	// one entry per cell of every level, plus one
+	vector<unsigned int> cell_prims;
+	vector<unsigned int> cell_sub;		// index in levels of the sub-grid of each cell, 0 if none
+	vector<GridLevel> levels;			// levels[0] is the top grid
 
 	int nx, ny, nz; // number of cells in the x, y, and z directions
-	float m = 2.0f; // factor that allows to vary the number of cells
+	float m = 0.0f; // factor that allows to vary the number of cells of the top grid; 0: chosen by the cost model
+
+	void setup_level(GridLevel& level, vector<unsigned int>& objs, float density);
+	void set_resolution(GridLevel& level, int n_objs);
+	float level_cost(GridLevel& level, vector<unsigned int>& objs);
+	void fill_cells(unsigned int level_index, vector<unsigned int>& objs);
+	unsigned int* mailbox(unsigned int& ray_id);
+	WalkResult walk(Ray& ray, unsigned int level_index, bool shadow, double length, HitRecord& hit, unsigned int* stamps, unsigned int ray_id);
 
 	//Setup function for Grid traversal
-	bool Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next, 
+	bool Init_Traverse(Ray& ray, GridLevel& level, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next, 
 		int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop);
 
 	AABB bbox;
 };
 
 /*********************************BVH*****************************************************************/
-class BVH
+class BVH : public Accelerator
 {
-	class Comparator {
-	public:
-		int dimension;
-
-		bool operator() (Object* a, Object* b) {
-			float ca = a->GetBoundingBox().centroid().getAxisValue(dimension);
-			float cb = b->GetBoundingBox().centroid().getAxisValue(dimension);
-			return ca < cb;
-		}
-	};
-
+	// 32 bytes with no vtable: two nodes fill a 64-byte cache line and siblings are stored side by side
 	class BVHNode {
 	private:
-		AABB bbox;
-		bool leaf;
-		unsigned int n_objs;
-		unsigned int index;	// if leaf == false: index to left child node,
-							// else if leaf == true: index to first Intersectable (Object *) in objects vector
+		float bmin[3];
+		unsigned int index;	// if n_objs == 0: index to left child node (the right child follows it),
+							// else: index to first Intersectable (Object *) in objects vector
+		float bmax[3];
+		unsigned int n_objs;	// 0 for interior nodes
 
 	public:
-		BVHNode(void);
 		void setAABB(AABB& bbox_);
+		AABB getAABB();
 		void makeLeaf(unsigned int index_, unsigned int n_objs_);
 		void makeNode(unsigned int left_index_);
-		bool isLeaf() { return leaf; }
+		bool isLeaf() { return n_objs != 0; }
 		unsigned int getIndex() { return index; }
 		unsigned int getNObjs() { return n_objs; }
-		AABB& getAABB() { return bbox; };
+		float getArea() { return getAABB().surface_area(); }
+	};
+	static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
+
+	// Node of the BVH_WIDTH-wide tree traversed by the renderer, collapsed from the binary tree.
+	// The children boxes are stored per coordinate (SoA), so one SSE slab test covers all of them.
+	// Unused slots hold a box at +infinity, which no ray can hit.
+	struct WideNode {
+		float bounds[6][BVH_WIDTH];		// min x, min y, min z, max x, max y, max z of every child
+		unsigned int child[BVH_WIDTH];	// if n_objs == 0: index to the child wide node, else: index to its first object
+		unsigned int n_objs[BVH_WIDTH];	// 0 for interior children
+	};
+	static_assert(sizeof(WideNode) == 128, "WideNode must stay two cache lines");
+
+	// object with its bounds and centroid, computed once per Build
+	struct BuildPrim {
+		Object* obj;
+		unsigned int index;  // of obj in the objects given to Build
+		AABB bbox;
+		Vector centroid;
 	};
 
+	// object with its Morton code, sorted by the linear builder
+	struct MortonPrim {
+		uint64_t code;
+		unsigned int index;  // into build_prims
+	};
+
+	// node of the temporary binary tree of the linear builder, which is restructured in place
+	struct LinearNode {
+		AABB bbox;
+		float cost;				// SAH cost of the subtree
+		int left, right;		// children, -1 for leaves
+		unsigned int first;		// leaves: first object in build_prims
+		unsigned int n_objs;	// objects in the subtree
+	};
+
+	typedef vector<BVHNode, AlignedAllocator<BVHNode, 64> > NodeArray;
+
 private:
-	int Threshold = 2;
-	int SAH_splits = 0;
+	int builder = BVH_BUILDER_SAH;  // used by Build
+	int leaf_size = PRIM_GROUP_SIZE;  // ranges with up to leaf_size objects become leaves, one SSE group
+	bool parallel_build = true;
+	bool treelet_optimization = true;  // linear builder only
+	float spatial_budget = 0.3f;  // spatial builder: references may grow by this fraction of the objects
+	size_t spatial_refs, spatial_refs_limit;
+	float spatial_root_area;
+	int fork_depth = 0;  // subtrees are built in parallel above this depth
 	vector<Object*> objects;
-	vector<BVH::BVHNode*> nodes;
+	NodeArray nodes;  // binary tree, one contiguous array, root at index 0; only alive during Build
+	vector<WideNode, AlignedAllocator<WideNode, 64> > wide_nodes;  // collapsed tree built by this process, root at index 0
+	const WideNode* wide_root = NULL;  // tree used for traversal: wide_nodes or the mapped cache file
+	size_t n_wide_nodes = 0;
+	string cache_dir;  // empty: no cache
+	MappedFile cache_file;
+	bool from_cache = false;
+	vector<BuildPrim> build_prims;  // only alive during Build
 
 	struct StackItem {
-		BVHNode* ptr;
-		float t;
-		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
+		unsigned int index;
+		unsigned int n_objs;	// > 0: leaf with n_objs objects starting at index
+		float t;				// entry distance of the node box
+		StackItem(void) { }
+		StackItem(unsigned int _index, unsigned int _n_objs, float _t) : index(_index), n_objs(_n_objs), t(_t) { }
 	};
 
-	stack<StackItem> hit_stack;
+	bool init_build(vector<Object*>& all_objs, int cache_builder, AABB& world_bbox, uint64_t& key);
+	void finish_build(uint64_t key);
+	void group_leaves(void);
+	void clear_tree(void);
+
+	uint64_t cache_key(int builder);
+	string cache_path(uint64_t key);
+	bool load_cache(uint64_t key, vector<Object*>& objs);
+	void save_cache(uint64_t key);
+
+	int linear_tree(vector<LinearNode>& tree, vector<unsigned int>& split, unsigned int node, unsigned int first, unsigned int last);
+	void optimize_treelets(vector<LinearNode>& tree, int node, int depth);
+	void restructure_treelet(vector<LinearNode>& tree, int root);
+	int rebuild_treelet(vector<LinearNode>& tree, int subset, int* leaves, int* internals, int& n_internals, AABB* bbox, float* cost, int* partition);
+	void emit_linear(vector<LinearNode>& tree, int node, unsigned int node_index, int depth);
+	void linear_leaves(vector<LinearNode>& tree, int node, vector<int>& leaves);
+	void emit_balanced(vector<LinearNode>& tree, vector<int>& leaves, int first, int last, unsigned int node_index);
+
+	void spatial_recursive(vector<BuildPrim>& refs, unsigned int node_index, int depth);
+	float object_split(vector<BuildPrim>& refs, int& axis, float& position, AABB& left_bbox, AABB& right_bbox);
+	float spatial_split(vector<BuildPrim>& refs, AABB& node_bbox, int& axis, float& position);
+	bool split_refs(vector<BuildPrim>& refs, int axis, float position, bool spatial, vector<BuildPrim>& left, vector<BuildPrim>& right);
+
+	int intercepts_children(const WideNode& node, const __m128* origin, const __m128* inv_dir, float t_max, float* t_entry);
 
 public:
 	BVH(void);
 	int getNumObjects();
 	
-	void Build(vector<Object*>& objects);
-	void build_recursive(int left_index, int right_index, BVHNode* node);
-	int SAH(int left_index, int right_index, BVHNode* node);
-	int find_split(int left_index, int right_index, BVHNode* node);
+	void setBuilder(int builder_);  // BVH_BUILDER_SAH, BVH_BUILDER_LINEAR or BVH_BUILDER_SPATIAL
+	void setLeafSize(int leaf_size_);
+	void setParallelBuild(bool parallel);  // the tree is the same either way
+	void setTreeletOptimization(bool optimize);
+	void setSpatialSplitBudget(float budget);
+	void setCacheDirectory(const string& dir);  // built trees are saved there and mapped by later builds of the same geometry
+	bool loadedFromCache() { return from_cache; }
+	
+	void Build(vector<Object*>& objects);  // with the builder set by setBuilder
+	void BuildSAH(vector<Object*>& objects);  // binned SAH: best trees
+	void BuildLinear(vector<Object*>& objects);  // Morton codes (LBVH): fastest builds, same traversal
+	void BuildSpatial(vector<Object*>& objects);  // SAH with spatial splits (SBVH): objects may be referenced by several leaves
+	void build_recursive(int left_index, int right_index, unsigned int node_index, int depth, NodeArray& out);
+	void append_subtree(NodeArray& out, unsigned int node_index, NodeArray& subtree);
+	int SAH(int left_index, int right_index);
+	int median_split(int left_index, int right_index, AABB& bbox);
 	AABB build_bbox(int left_index, int right_index);
-	bool Traverse(Ray& ray, Object** hit_obj, Vector& hit_point);
-	bool Traverse(Ray& ray);
+	void collapse(unsigned int node_index, unsigned int wide_index);
+	bool Traverse(Ray& ray, HitRecord& hit);
+	bool Traverse(const Ray& ray, float t_max);
+	AcceleratorStats getStats();
+};
+
+/*********************************kd-tree*************************************************************/
+// kd-tree with SAH splits placed at the object bounds. Objects straddling a split plane are 
+// referenced by both sides, so leaves are tight and rays stop at the first leaf with a hit.
+class KdTree : public Accelerator
+{
+	// 8 bytes: interior nodes keep the below child right after them
+	class KdNode {
+	private:
+		union {
+			float split;			// interior: position of the split plane
+			unsigned int first;		// leaf: index to its first object in leaf_prims
+		};
+		unsigned int flags;			// bits 0-1: split axis, 3 for leaves; bits 2-31: interior: index to the above child, leaf: number of objects
+
+	public:
+		void makeLeaf(unsigned int first_, unsigned int n_objs_);
+		void makeNode(int axis_, float split_, unsigned int above_);
+		bool isLeaf() { return (flags & 3) == 3; }
+		int getAxis() { return flags & 3; }
+		float getSplit() { return split; }
+		unsigned int getAbove() { return flags >> 2; }
+		unsigned int getFirst() { return first; }
+		unsigned int getNObjs() { return flags >> 2; }
+	};
+	static_assert(sizeof(KdNode) == 8, "KdNode must stay 8 bytes");
+
+	// start or end of the bounds of an object along the axis being split
+	struct KdEdge {
+		float t;
+		unsigned int prim;
+		bool start;
+		bool operator<(const KdEdge& e) const { return t == e.t ? start > e.start : t < e.t; }  // starts first on ties
+	};
+
+	struct StackItem {
+		unsigned int node;
+		float t_min, t_max;
+	};
+
+	vector<Object*> objects;
+	vector<KdNode> nodes;  // root at index 0
+	vector<unsigned int> leaf_prims;  // indices into objects
+	AABB bbox;
+	int max_depth;
+
+	void build_recursive(AABB& node_bbox, vector<unsigned int>& prims, int depth, int bad_refines);
+	bool clip(float* origin, float* inv_dir, float& t_min, float& t_max);
+
+public:
+	KdTree(void);
+	int getNumObjects();
+	void Build(vector<Object*>& objs);
+	bool Traverse(Ray& ray, HitRecord& hit);
+	bool Traverse(const Ray& ray, float t_max);
+	AcceleratorStats getStats();
 };
 #endif
\ No newline at end of file
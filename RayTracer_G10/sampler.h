@@ -0,0 +1,72 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+// Random number generator for the renderer: PCG32 (M. O'Neill, www.pcg-random.org),
+// a 64-bit LCG whose output is permuted down to 32 bits.
+// A sampler is keyed by (pixel, sample, bounce): the key picks both the starting state
+// and the stream, so the numbers of a sample are the same whichever thread renders it
+// and in whatever order the tiles are scheduled.
+
+class Sampler
+{
+public:
+	Sampler(void) { Seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+	Sampler(uint32_t pixel, uint32_t sample, uint32_t bounce = 0) { Key(pixel, sample, bounce); }
+
+	void Seed(uint64_t init_state, uint64_t init_seq);
+	void Key(uint32_t pixel, uint32_t sample, uint32_t bounce = 0);
+	void NextBounce() { Key(pixel, sample, bounce + 1); }  // fresh numbers for the next path vertex of this sample
+
+	uint32_t NextUInt(void);
+	float NextFloat(void);    // uniform in [0, 1[
+	double NextDouble(void);  // uniform in [0, 1[
+
+private:
+	uint64_t state, inc;
+	uint32_t pixel, sample, bounce;
+};
+
+// ---------------------------------------------------- seed
+// pcg32_srandom_r: init_seq selects one of 2^63 streams
+inline void Sampler::Seed(uint64_t init_state, uint64_t init_seq) {
+	state = 0u;
+	inc = (init_seq << 1u) | 1u;
+	NextUInt();
+	state += init_state;
+	NextUInt();
+	pixel = sample = bounce = 0;
+}
+
+// ---------------------------------------------------- key
+// the pixel selects the stream; sample and bounce are hashed (splitmix64 finalizer)
+// into the starting state so that neighbouring keys give unrelated sequences
+inline void Sampler::Key(uint32_t pixel_, uint32_t sample_, uint32_t bounce_) {
+	uint64_t z = (((uint64_t)sample_ << 32) | bounce_) + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z = z ^ (z >> 31);
+
+	Seed(z, pixel_);
+	pixel = pixel_; sample = sample_; bounce = bounce_;
+}
+
+// ---------------------------------------------------- next
+inline uint32_t Sampler::NextUInt(void) {
+	uint64_t old_state = state;
+	state = old_state * 6364136223846793005ULL + inc;
+	uint32_t xorshifted = (uint32_t)(((old_state >> 18u) ^ old_state) >> 27u);
+	uint32_t rot = (uint32_t)(old_state >> 59u);
+	return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+inline float Sampler::NextFloat(void) {
+	return (NextUInt() >> 8) * (1.0f / 16777216.0f);  // 24 bits: exactly representable, never reaches 1
+}
+
+inline double Sampler::NextDouble(void) {
+	return NextUInt() * (1.0 / 4294967296.0);
+}
+
+#endif
@@ -0,0 +1,335 @@
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+// Spatial split BVH builder (SBVH, M. Stich, H. Friedrich, A. Dietrich, "Spatial Splits in
+// Bounding Volume Hierarchies", HPG 2009). Where the children of the best object split overlap,
+// splitting space instead is also tried: objects crossing the plane are clipped and referenced
+// from both sides, which removes the overlap that large objects (ground triangles next to
+// small detailed geometry) force on the object splits.
+// The number of references is bounded by spatial_budget; once it is used up only object
+// splits are made. The tree has the same layout as Build, so it is collapsed and traversed
+// in the same way; leaves may share objects.
+
+static inline bool is_empty_bbox(AABB& bbox) {
+	return bbox.min.x > bbox.max.x || bbox.min.y > bbox.max.y || bbox.min.z > bbox.max.z;
+}
+
+static inline AABB empty_bbox(void) {
+	return AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+}
+
+void BVH::setSpatialSplitBudget(float budget) { this->spatial_budget = budget < 0.0f ? 0.0f : budget; }
+
+void BVH::BuildSpatial(vector<Object *> &all_objs) {
+	AABB world_bbox;
+	uint64_t key;
+
+	if (!init_build(all_objs, BVH_BUILDER_SPATIAL, world_bbox, key)) return;
+
+	// the references are moved down the tree and written back to build_prims leaf by leaf
+	vector<BuildPrim> refs;
+	refs.swap(build_prims);
+
+	spatial_refs = refs.size();
+	spatial_refs_limit = refs.size() + (size_t)(spatial_budget * refs.size());
+	spatial_root_area = world_bbox.surface_area();
+
+	build_prims.reserve(spatial_refs_limit);
+	nodes.reserve(2 * spatial_refs_limit + 2);
+
+	spatial_recursive(refs, 0, 0);
+
+	finish_build(key);
+}
+
+// spatial_recursive: splits refs, the references inside nodes[node_index], by the cheapest of
+// the best object split and the best spatial split; leaves append their references to build_prims.
+// Below BVH_MAX_SAH_DEPTH, and when neither split separates the references, they are split
+// at their median instead.
+void BVH::spatial_recursive(vector<BuildPrim>& refs, unsigned int node_index, int depth) {
+	int n_refs = refs.size();
+
+	if (n_refs <= leaf_size) {
+		nodes[node_index].makeLeaf(build_prims.size(), n_refs);
+		build_prims.insert(build_prims.end(), refs.begin(), refs.end());
+		return;
+	}
+
+	vector<BuildPrim> left, right;
+	bool split = false;
+
+	if (depth < BVH_MAX_SAH_DEPTH) {
+		AABB node_bbox = nodes[node_index].getAABB();
+		AABB left_bbox, right_bbox;
+		int object_axis = -1, spatial_axis = -1;
+		float object_position = 0.0f, spatial_position = 0.0f;
+
+		float object_cost = object_split(refs, object_axis, object_position, left_bbox, right_bbox);
+		float spatial_cost = FLT_MAX;
+
+		if (spatial_refs < spatial_refs_limit && object_axis >= 0) {
+			// area of the overlap of the object split children
+			AABB overlap = left_bbox;
+			overlap.min = Vector(MAX(left_bbox.min.x, right_bbox.min.x), MAX(left_bbox.min.y, right_bbox.min.y), MAX(left_bbox.min.z, right_bbox.min.z));
+			overlap.max = Vector(MIN(left_bbox.max.x, right_bbox.max.x), MIN(left_bbox.max.y, right_bbox.max.y), MIN(left_bbox.max.z, right_bbox.max.z));
+
+			if (!is_empty_bbox(overlap) && overlap.surface_area() > BVH_SBVH_ALPHA * spatial_root_area)
+				spatial_cost = spatial_split(refs, node_bbox, spatial_axis, spatial_position);
+		}
+		else if (spatial_refs < spatial_refs_limit)
+			spatial_cost = spatial_split(refs, node_bbox, spatial_axis, spatial_position);
+
+		if (spatial_axis >= 0 && spatial_cost < object_cost)
+			split = split_refs(refs, spatial_axis, spatial_position, true, left, right);
+
+		if (!split && object_axis >= 0)
+			split = split_refs(refs, object_axis, object_position, false, left, right);
+	}
+
+	if (!split) {
+		// median of the centroids along the largest axis of the node
+		AABB bbox = nodes[node_index].getAABB();
+		int axis = (bbox.max - bbox.min).largest_coordinate();
+		int mid = n_refs / 2;
+
+		nth_element(refs.begin(), refs.begin() + mid, refs.end(), [axis](BuildPrim& a, BuildPrim& b) {
+			return a.centroid.getAxisValue(axis) < b.centroid.getAxisValue(axis);
+		});
+
+		left.assign(refs.begin(), refs.begin() + mid);
+		right.assign(refs.begin() + mid, refs.end());
+	}
+
+	// the references of this node are no longer needed while the subtrees are built
+	vector<BuildPrim>().swap(refs);
+
+	AABB left_bbox = empty_bbox(), right_bbox = empty_bbox();
+	for (BuildPrim& ref : left) left_bbox.extend(ref.bbox);
+	for (BuildPrim& ref : right) right_bbox.extend(ref.bbox);
+
+	unsigned int left_node = nodes.size();
+	unsigned int right_node = left_node + 1;
+
+	nodes[node_index].makeNode(left_node);
+
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+	nodes[left_node].setAABB(left_bbox);
+	nodes[right_node].setAABB(right_bbox);
+
+	this->spatial_recursive(left, left_node, depth + 1);
+	this->spatial_recursive(right, right_node, depth + 1);
+}
+
+// object_split: binned SAH over the centroids of the references, as in SAH. Returns the cost of
+// the best split (FLT_MAX if there is none), its axis and plane position, and the bounds of
+// the two sides.
+float BVH::object_split(vector<BuildPrim>& refs, int& axis, float& position, AABB& left_bbox, AABB& right_bbox) {
+	struct Bin {
+		AABB bbox;
+		int count;
+	};
+
+	int n_refs = refs.size();
+	AABB centroid_bbox = empty_bbox();
+
+	for (BuildPrim& ref : refs)
+		centroid_bbox.extend(AABB(ref.centroid, ref.centroid));
+
+	float min_cost = FLT_MAX;
+	axis = -1;
+
+	for (int a = 0; a < 3; a++) {
+		float c_min = centroid_bbox.min.getAxisValue(a);
+		float extent = centroid_bbox.max.getAxisValue(a) - c_min;
+		if (extent <= 0.0f) continue;
+
+		float scale = BVH_SAH_BINS / extent;
+		Bin bins[BVH_SAH_BINS];
+
+		for (int b = 0; b < BVH_SAH_BINS; b++) {
+			bins[b].bbox = empty_bbox();
+			bins[b].count = 0;
+		}
+
+		for (BuildPrim& ref : refs) {
+			int b = (int)((ref.centroid.getAxisValue(a) - c_min) * scale);
+			if (b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
+
+			bins[b].count++;
+			bins[b].bbox.extend(ref.bbox);
+		}
+
+		AABB right_boxes[BVH_SAH_BINS];
+		int right_counts[BVH_SAH_BINS];
+		AABB right_acc = empty_bbox();
+		int right_count = 0;
+
+		for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+			right_acc.extend(bins[b].bbox);
+			right_count += bins[b].count;
+			right_boxes[b] = right_acc;
+			right_counts[b] = right_count;
+		}
+
+		AABB left_acc = empty_bbox();
+		int left_count = 0;
+
+		for (int p = 1; p < BVH_SAH_BINS; p++) {
+			left_acc.extend(bins[p - 1].bbox);
+			left_count += bins[p - 1].count;
+
+			if (left_count == 0 || left_count == n_refs) continue;
+
+			float cost = left_acc.surface_area() * left_count + right_boxes[p].surface_area() * right_counts[p];
+
+			if (cost < min_cost) {
+				min_cost = cost;
+				axis = a;
+				position = c_min + p / scale;
+				left_bbox = left_acc;
+				right_bbox = right_boxes[p];
+			}
+		}
+	}
+
+	return min_cost;
+}
+
+// spatial_split: BVH_SBVH_BINS equal slabs of the node box along each axis. Every reference is
+// clipped to each slab it overlaps and counted as entering its first slab and leaving its last,
+// so the sweep gives the cost of splitting space at every slab boundary. Returns the cost of
+// the best one (FLT_MAX if there is none), its axis and position.
+float BVH::spatial_split(vector<BuildPrim>& refs, AABB& node_bbox, int& axis, float& position) {
+	struct Bin {
+		AABB bbox;
+		int entries, exits;
+	};
+
+	float min_cost = FLT_MAX;
+	axis = -1;
+
+	for (int a = 0; a < 3; a++) {
+		float b_min = node_bbox.min.getAxisValue(a);
+		float extent = node_bbox.max.getAxisValue(a) - b_min;
+		if (extent <= 0.0f) continue;
+
+		float width = extent / BVH_SBVH_BINS;
+		float inv_width = BVH_SBVH_BINS / extent;
+		Bin bins[BVH_SBVH_BINS];
+
+		for (int b = 0; b < BVH_SBVH_BINS; b++) {
+			bins[b].bbox = empty_bbox();
+			bins[b].entries = bins[b].exits = 0;
+		}
+
+		for (BuildPrim& ref : refs) {
+			int first = (int)((ref.bbox.min.getAxisValue(a) - b_min) * inv_width);
+			int last = (int)((ref.bbox.max.getAxisValue(a) - b_min) * inv_width);
+			first = MIN(MAX(first, 0), BVH_SBVH_BINS - 1);
+			last = MIN(MAX(last, first), BVH_SBVH_BINS - 1);
+
+			if (first == last) bins[first].bbox.extend(ref.bbox);
+
+			else {
+				for (int b = first; b <= last; b++) {
+					AABB slab = ref.bbox;
+					if (b > first) slab.min.setAxisValue(a, b_min + b * width);
+					if (b < last) slab.max.setAxisValue(a, b_min + (b + 1) * width);
+
+					AABB clipped = ref.obj->GetClippedBoundingBox(slab);
+					if (!is_empty_bbox(clipped)) bins[b].bbox.extend(clipped);
+				}
+			}
+
+			bins[first].entries++;
+			bins[last].exits++;
+		}
+
+		AABB right_boxes[BVH_SBVH_BINS];
+		int right_counts[BVH_SBVH_BINS];
+		AABB right_acc = empty_bbox();
+		int right_count = 0;
+
+		for (int b = BVH_SBVH_BINS - 1; b > 0; b--) {
+			right_acc.extend(bins[b].bbox);
+			right_count += bins[b].exits;
+			right_boxes[b] = right_acc;
+			right_counts[b] = right_count;
+		}
+
+		AABB left_acc = empty_bbox();
+		int left_count = 0;
+
+		for (int p = 1; p < BVH_SBVH_BINS; p++) {
+			left_acc.extend(bins[p - 1].bbox);
+			left_count += bins[p - 1].entries;
+
+			if (left_count == 0 || right_counts[p] == 0) continue;
+
+			float cost = left_acc.surface_area() * left_count + right_boxes[p].surface_area() * right_counts[p];
+
+			if (cost < min_cost) {
+				min_cost = cost;
+				axis = a;
+				position = b_min + p * width;
+			}
+		}
+	}
+
+	return min_cost;
+}
+
+// split_refs: distributes refs to left and right of the plane at position on axis, by centroid
+// for object splits and by extent for spatial splits, where references that cross the plane are
+// clipped into both sides while the budget lasts (over budget they go whole to the side of
+// their centroid). Returns false if one side would be empty.
+bool BVH::split_refs(vector<BuildPrim>& refs, int axis, float position, bool spatial, vector<BuildPrim>& left, vector<BuildPrim>& right) {
+	left.clear();
+	right.clear();
+
+	size_t new_refs = 0;
+
+	for (BuildPrim& ref : refs) {
+		float r_min = ref.bbox.min.getAxisValue(axis), r_max = ref.bbox.max.getAxisValue(axis);
+
+		if (!spatial || r_max <= position || r_min >= position || spatial_refs + new_refs >= spatial_refs_limit) {
+			if (ref.centroid.getAxisValue(axis) < position) left.push_back(ref);
+			else right.push_back(ref);
+			continue;
+		}
+
+		AABB left_slab = ref.bbox, right_slab = ref.bbox;
+		left_slab.max.setAxisValue(axis, position);
+		right_slab.min.setAxisValue(axis, position);
+
+		BuildPrim left_ref = ref, right_ref = ref;
+		left_ref.bbox = ref.obj->GetClippedBoundingBox(left_slab);
+		right_ref.bbox = ref.obj->GetClippedBoundingBox(right_slab);
+		left_ref.centroid = left_ref.bbox.centroid();
+		right_ref.centroid = right_ref.bbox.centroid();
+
+		bool in_left = !is_empty_bbox(left_ref.bbox), in_right = !is_empty_bbox(right_ref.bbox);
+
+		if (in_left && in_right) {
+			left.push_back(left_ref);
+			right.push_back(right_ref);
+			new_refs++;
+		}
+		else if (in_left) left.push_back(left_ref);
+		else if (in_right) right.push_back(right_ref);
+		else if (ref.centroid.getAxisValue(axis) < position) left.push_back(ref);  // only touches the plane
+		else right.push_back(ref);
+	}
+
+	if (left.empty() || right.empty()) {
+		left.clear();
+		right.clear();
+		return false;
+	}
+
+	spatial_refs += new_refs;
+	return true;
+}
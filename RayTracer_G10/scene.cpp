@@ -5,20 +5,14 @@
 #include "maths.h"
 #include "scene.h"
 #include "macros.h"
-
-float calculateDeterminant2x2(float f1, float f2, float f3, float f4) {
-	return (f1 * f4) - (f2 * f3);
-}
-
-float calculateDeterminant3x3(Vector v1, Vector v2, Vector v3) {
-	return v1.x * calculateDeterminant2x2(v2.y, v2.z, v3.y, v3.z)
-		- v1.y * calculateDeterminant2x2(v2.x, v2.z, v3.x, v3.z)
-		+ v1.z * calculateDeterminant2x2(v2.x, v2.y, v3.x, v3.y);
-}
+#include "instance.h"
+#include "primitives.h"
 
 Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2)
 {
 	points[0] = P0; points[1] = P1; points[2] = P2;
+	edge1 = P1 - P0;
+	edge2 = P2 - P0;
 
 	/* Calculate the normal */
 	normal = Vector(0, 0, 0);
@@ -46,9 +40,108 @@ AABB Triangle::GetBoundingBox() {
 	return(AABB(Min, Max));
 }
 
-Vector Triangle::getNormal(Vector point)
-{
-	return normal;
+// Separating axis test (T. Akenine-Moller, "Fast 3D Triangle-Box Overlap Testing"): the 
+// triangle and the box are disjoint if their projections are disjoint on one of the three 
+// box axes, the triangle normal or the nine cross products of box axes and triangle edges.
+static bool triangle_overlaps_box(Vector& p0, Vector& p1, Vector& p2, AABB& box) {
+	Vector* points[3] = { &p0, &p1, &p2 };
+	float c[3] = { (box.min.x + box.max.x) * 0.5f, (box.min.y + box.max.y) * 0.5f, (box.min.z + box.max.z) * 0.5f };
+	float h[3] = { (box.max.x - box.min.x) * 0.5f, (box.max.y - box.min.y) * 0.5f, (box.max.z - box.min.z) * 0.5f };
+	float v[3][3], e[3][3];
+
+	for (int i = 0; i < 3; i++)  // vertices relative to the box center
+		for (int a = 0; a < 3; a++)
+			v[i][a] = points[i]->getAxisValue(a) - c[a];
+
+	// box axes: the bounds of the triangle against the box
+	for (int a = 0; a < 3; a++) {
+		if (MIN(v[0][a], MIN(v[1][a], v[2][a])) > h[a]) return false;
+		if (MAX(v[0][a], MAX(v[1][a], v[2][a])) < -h[a]) return false;
+	}
+
+	for (int a = 0; a < 3; a++) {
+		e[0][a] = v[1][a] - v[0][a];
+		e[1][a] = v[2][a] - v[1][a];
+		e[2][a] = v[0][a] - v[2][a];
+	}
+
+	// box axis x triangle edge
+	for (int i = 0; i < 3; i++) {
+		for (int a = 0; a < 3; a++) {
+			int a1 = (a + 1) % 3, a2 = (a + 2) % 3;
+			float axis[3];
+			axis[a] = 0.0f;
+			axis[a1] = -e[i][a2];
+			axis[a2] = e[i][a1];
+
+			float p0 = axis[a1] * v[0][a1] + axis[a2] * v[0][a2];
+			float p1 = axis[a1] * v[1][a1] + axis[a2] * v[1][a2];
+			float p2 = axis[a1] * v[2][a1] + axis[a2] * v[2][a2];
+			float r = h[a1] * fabs(axis[a1]) + h[a2] * fabs(axis[a2]);
+
+			if (MIN(p0, MIN(p1, p2)) > r || MAX(p0, MAX(p1, p2)) < -r) return false;
+		}
+	}
+
+	// triangle normal: the plane of the triangle against the box
+	float n[3] = { e[0][1] * e[1][2] - e[0][2] * e[1][1], e[0][2] * e[1][0] - e[0][0] * e[1][2], e[0][0] * e[1][1] - e[0][1] * e[1][0] };
+	float d = n[0] * v[0][0] + n[1] * v[0][1] + n[2] * v[0][2];
+	float r = h[0] * fabs(n[0]) + h[1] * fabs(n[1]) + h[2] * fabs(n[2]);
+
+	return fabs(d) <= r;
+}
+
+// The triangle is clipped by the six planes of the box (Sutherland-Hodgman), each of which 
+// adds at most one vertex to the polygon, and the remaining polygon is bounded.
+static AABB clip_triangle(Vector& p0, Vector& p1, Vector& p2, AABB& box) {
+	Vector polygon[9], clipped[9];
+	int n = 3;
+
+	polygon[0] = p0; polygon[1] = p1; polygon[2] = p2;
+
+	for (int plane = 0; plane < 6 && n > 0; plane++) {
+		int axis = plane % 3;
+		bool is_max = plane >= 3;
+		float bound = is_max ? box.max.getAxisValue(axis) : box.min.getAxisValue(axis);
+		int m = 0;
+
+		for (int i = 0; i < n; i++) {
+			Vector& a = polygon[i];
+			Vector& b = polygon[(i + 1) % n];
+			float da = is_max ? bound - a.getAxisValue(axis) : a.getAxisValue(axis) - bound;  // >= 0: inside
+			float db = is_max ? bound - b.getAxisValue(axis) : b.getAxisValue(axis) - bound;
+
+			if (da >= 0) clipped[m++] = a;
+			if ((da >= 0) != (db >= 0)) {
+				Vector p = a + (b - a) * (da / (da - db));
+				p.setAxisValue(axis, bound);  // exactly on the plane despite rounding
+				clipped[m++] = p;
+			}
+		}
+
+		n = m;
+		for (int i = 0; i < n; i++) polygon[i] = clipped[i];
+	}
+
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	AABB bbox = AABB(min, max);
+
+	for (int i = 0; i < n; i++)
+		bbox.extend(AABB(polygon[i], polygon[i]));
+
+	return bbox;
+}
+
+bool Triangle::OverlapsBox(AABB& box) {
+	return triangle_overlaps_box(points[0], points[1], points[2], box);
+}
+
+AABB Triangle::GetClippedBoundingBox(AABB& box) {
+	return clip_triangle(points[0], points[1], points[2], box);
+}
+
+static inline bool intersect_triangle(const Vector& p0, const Vector& edge1, const Vector& edge2, Ray& r, float& t, float& u, float& v) {
+	return intersect_triangle(p0.x, p0.y, p0.z, edge1.x, edge1.y, edge1.z, edge2.x, edge2.y, edge2.z, r, t, u, v);
 }
 
 //
@@ -56,21 +149,107 @@ Vector Triangle::getNormal(Vector point)
 //
 
 bool Triangle::intercepts(Ray& r, float& t ) {
+	float u, v;
+
+	return intercepts(r, t, u, v);
+}
 
-	Vector o_a = r.origin - points[0];
-	Vector c_a = points[2] - points[0];
-	Vector _d = r.direction * (-1);
-	Vector b_a = points[1] - points[0];
-	float beta = calculateDeterminant3x3(o_a, c_a, _d) / calculateDeterminant3x3(b_a, c_a, _d);
+bool Triangle::intercepts(Ray& r, float& t, float& u, float& v) {
+	return intersect_triangle(points[0], edge1, edge2, r, t, u, v);
+}
 
-	if (beta < 0 || beta > 1) return false;
+PrimRef Triangle::storeIn(PrimitiveStore& store) {
+	return store.addTriangle(this, points[0], edge1, edge2);
+}
 
-	float gamma = calculateDeterminant3x3(b_a, o_a, _d) / calculateDeterminant3x3(b_a, c_a, _d);
-	if (gamma < 0 || beta + gamma > 1) return false;
+unsigned int Triangle::getGeometry(float* data) {
+	for (int i = 0; i < 3; i++) {
+		data[3 * i] = points[i].x; data[3 * i + 1] = points[i].y; data[3 * i + 2] = points[i].z;
+	}
+	return 9;
+}
+
+bool Triangle::intercepts(Ray& r, HitRecord& hit) {
+	float t, u, v;
+
+	if (!intercepts(r, t, u, v) || t >= hit.t) return false;
+
+	hit.set(t, this, normal, u, v);
+	return true;
+}
+
+// --------------------------------------------------------------------- TriangleMesh
+TriangleMesh::TriangleMesh(vector<Vector>& vertices_, vector<uint32_t>& indices_, Material* material) {
+	vertices.swap(vertices_);
+	indices.swap(indices_);
+
+	uint32_t n_faces = (uint32_t)(indices.size() / 3);
+	faces.reserve(n_faces);
+	for (uint32_t face = 0; face < n_faces; face++) {
+		faces.push_back(MeshTriangle(this, face));
+		faces.back().SetMaterial(material);
+	}
+}
+
+bool MeshTriangle::intercepts(Ray& r, float& t) {
+	float u, v;
+
+	return intercepts(r, t, u, v);
+}
+
+bool MeshTriangle::intercepts(Ray& r, float& t, float& u, float& v) {
+	Vector& p0 = mesh->getVertex(face, 0);
+
+	return intersect_triangle(p0, mesh->getVertex(face, 1) - p0, mesh->getVertex(face, 2) - p0, r, t, u, v);
+}
+
+// the normal is only computed for the hits closer than the previous ones
+bool MeshTriangle::intercepts(Ray& r, HitRecord& hit) {
+	float t, u, v;
+	Vector& p0 = mesh->getVertex(face, 0);
+	Vector edge1 = mesh->getVertex(face, 1) - p0;
+	Vector edge2 = mesh->getVertex(face, 2) - p0;
+
+	if (!intersect_triangle(p0, edge1, edge2, r, t, u, v) || t >= hit.t) return false;
+
+	Vector normal = edge1 % edge2;
+	hit.set(t, this, normal.normalize(), u, v);
+	return true;
+}
+
+// the same bounds as a Triangle with these vertices
+AABB MeshTriangle::GetBoundingBox() {
+	Vector& p0 = mesh->getVertex(face, 0);
+	Vector& p1 = mesh->getVertex(face, 1);
+	Vector& p2 = mesh->getVertex(face, 2);
+	Vector Min = Vector(min(p0.x, min(p1.x, p2.x)), min(p0.y, min(p1.y, p2.y)), min(p0.z, min(p1.z, p2.z)));
+	Vector Max = Vector(max(p0.x, max(p1.x, p2.x)), max(p0.y, max(p1.y, p2.y)), max(p0.z, max(p1.z, p2.z)));
+
+	Min -= EPSILON;
+	Max += EPSILON;
+	return AABB(Min, Max);
+}
+
+PrimRef MeshTriangle::storeIn(PrimitiveStore& store) {
+	Vector& p0 = mesh->getVertex(face, 0);
+
+	return store.addTriangle(this, p0, mesh->getVertex(face, 1) - p0, mesh->getVertex(face, 2) - p0);
+}
+
+unsigned int MeshTriangle::getGeometry(float* data) {
+	for (int i = 0; i < 3; i++) {
+		Vector& p = mesh->getVertex(face, i);
+		data[3 * i] = p.x; data[3 * i + 1] = p.y; data[3 * i + 2] = p.z;
+	}
+	return 9;
+}
+
+bool MeshTriangle::OverlapsBox(AABB& box) {
+	return triangle_overlaps_box(mesh->getVertex(face, 0), mesh->getVertex(face, 1), mesh->getVertex(face, 2), box);
+}
 
-	t = calculateDeterminant3x3(b_a, c_a, o_a) / calculateDeterminant3x3(b_a, c_a, _d);
-	if (t < 0) return false;
-	return (true);
+AABB MeshTriangle::GetClippedBoundingBox(AABB& box) {
+	return clip_triangle(mesh->getVertex(face, 0), mesh->getVertex(face, 1), mesh->getVertex(face, 2), box);
 }
 
 Plane::Plane(Vector& a_PN, float a_D)
@@ -82,7 +261,7 @@ Plane::Plane(Vector& P0, Vector& P1, Vector& P2)
    float l;
 
    //Calculate the normal plane: counter-clockwise vectorial product.
-   PN = Vector(0, 0, 0);		
+   PN = (P1 - P0) % (P2 - P0);
 
    if ((l=PN.length()) == 0.0)
    {
@@ -92,7 +271,7 @@ Plane::Plane(Vector& P0, Vector& P1, Vector& P2)
    {
      PN.normalize();
 	 //Calculate D
-     D  = 0.0f;
+     D  = -(PN * P0);
    }
 }
 
@@ -106,36 +285,79 @@ bool Plane::intercepts( Ray& r, float& t )
 	return (t > 0);
 }
 
-Vector Plane::getNormal(Vector point) 
+bool Plane::intercepts(Ray& r, HitRecord& hit)
 {
-  return PN;
+	float t;
+
+	if (!intercepts(r, t) || t >= hit.t) return false;
+
+	hit.set(t, this, PN);
+	return true;
+}
+
+AABB Plane::GetBoundingBox(void)
+{
+	return(AABB(Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX), Vector(FLT_MAX, FLT_MAX, FLT_MAX)));
 }
 
 bool Sphere::intercepts(Ray& r, float& t )
 {
-	Vector oc = this->center - r.origin;
-	float b = r.direction * oc;
-	float c = oc * oc - this->SqRadius;
-	float discr = pow(b, 2) - c;
+	return intersect_sphere(center.x, center.y, center.z, SqRadius, r, t);
+}
 
-	if (discr <= 0) return false;
 
-	if (c > 0.0f) {
-		if (b <= 0.0f) return false;
+PrimRef Sphere::storeIn(PrimitiveStore& store) {
+	return store.addSphere(this, center, radius);
+}
 
-		t = b - sqrt(pow(b, 2) - c);
-	}
+unsigned int Sphere::getGeometry(float* data) {
+	data[0] = center.x; data[1] = center.y; data[2] = center.z; data[3] = radius;
+	return 4;
+}
+
+// The sphere overlaps the box if the point of the box closest to the center is inside it
+bool Sphere::OverlapsBox(AABB& box) {
+	float dx = center.x - MAX(box.min.x, MIN(center.x, box.max.x));
+	float dy = center.y - MAX(box.min.y, MIN(center.y, box.max.y));
+	float dz = center.z - MAX(box.min.z, MIN(center.z, box.max.z));
+
+	return dx * dx + dy * dy + dz * dz <= SqRadius;
+}
 
-	else t = b + sqrt(pow(b, 2) - c);
+bool Sphere::intercepts(Ray& r, HitRecord& hit)
+{
+	float t;
+
+	if (!intercepts(r, t) || t >= hit.t) return false;
 
+	Vector normal = r.origin + r.direction * t - center;
+	hit.set(t, this, normal.normalize());
 	return true;
 }
 
+// Default clipping: the overlap of the object bounds with the box. Conservative, which is all 
+// the spatial splits of the BVH need; Triangle clips its actual shape.
+AABB Object::GetClippedBoundingBox(AABB& box) {
+	AABB bbox = GetBoundingBox();
 
-Vector Sphere::getNormal( Vector point )
-{
-	Vector normal = point - center;
-	return (normal.normalize());
+	bbox.min = Vector(MAX(bbox.min.x, box.min.x), MAX(bbox.min.y, box.min.y), MAX(bbox.min.z, box.min.z));
+	bbox.max = Vector(MIN(bbox.max.x, box.max.x), MIN(bbox.max.y, box.max.y), MIN(bbox.max.z, box.max.z));
+
+	return bbox;
+}
+
+// Default storage: the object itself, tested through its virtual methods
+PrimRef Object::storeIn(PrimitiveStore& store) {
+	return store.addObject(this);
+}
+
+// Default overlap test: the bounds of the object overlap the box
+bool Object::OverlapsBox(AABB& box) {
+	AABB bbox = GetBoundingBox();
+
+	return bbox.min.x <= box.max.x && bbox.max.x >= box.min.x &&
+		bbox.min.y <= box.max.y && bbox.max.y >= box.min.y &&
+		bbox.min.z <= box.max.z && bbox.max.z >= box.min.z;
 }
 
 AABB Sphere::GetBoundingBox() {
@@ -157,85 +379,27 @@ AABB aaBox::GetBoundingBox() {
 
 bool aaBox::intercepts(Ray& ray, float& t)
 {
-	double tx_min, ty_min, tz_min;
-	double tx_max, ty_max, tz_max;
-	double a = 1.0 / ray.direction.x;
-	double b = 1.0 / ray.direction.y;
-	double c = 1.0 / ray.direction.z;
-	float tE, tL;
-	Vector face_in, face_out;
-
-	if (a >= 0) {
-		tx_min = (this->min.x - ray.origin.x) * a;
-		tx_max = (this->max.x - ray.origin.x) * a;
-	}
-	else {
-		tx_min = (this->max.x - ray.origin.x) * a;
-		tx_max = (this->min.x - ray.origin.x) * a;
-	}
-	
-	if (b >= 0) {
-		ty_min = (this->min.y - ray.origin.y) * b;
-		ty_max = (this->max.y - ray.origin.y) * b;
-	}
-	else {
-		ty_min = (this->max.y - ray.origin.y) * b;
-		ty_max = (this->min.y - ray.origin.y) * b;
-	}
-
-	if (c >= 0) {
-		tz_min = (this->min.z - ray.origin.z) * c;
-		tz_max = (this->max.z - ray.origin.z) * c;
-	}
-	else {
-		tz_min = (this->max.z - ray.origin.z) * c;
-		tz_max = (this->min.z - ray.origin.z) * c;
-	}
+	int face;
 
-	if (tx_min > ty_min) {
-		tE = tx_min;
-		face_in = (a >= 0.0) ? Vector(-1, 0, 0) : Vector(1, 0, 0);
-	}
-	else {
-		tE = ty_min;
-		face_in = (b >= 0.0) ? Vector(0, -1, 0) : Vector(0, 1, 0);
-	}
-	if (tz_min > tE) {
-		tE = tz_min;
-		face_in = (c >= 0.0) ? Vector(0, 0, -1) : Vector(0, 0, 1);
-	}
-
-	if (tx_max < ty_max) {
-		tL = tx_max;
-		face_out = (a >= 0.0) ? Vector(1, 0, 0) : Vector(-1, 0, 0);
-	}
-	else {
-		tL = ty_max;
-		face_out = (b >= 0.0) ? Vector(0, 1, 0) : Vector(0, -1, 0);
-	}
-	if (tz_max < tL) {
-		tL = tz_max;
-		face_out = (c >= 0.0) ? Vector(0, 0, 1) : Vector(0, 0, -1);
-	}
-
-	if (tE < tL && tL > 0) {
-		if (tE > 0) {
-			t = tE;
-			Normal = face_in;
-		}
-		else {
-			t = tL;
-			Normal = face_out;
-		}
-		return true;
-	}
+	return intersect_box(min.x, min.y, min.z, max.x, max.y, max.z, ray, t, face);
+}
 
-	return false;
+PrimRef aaBox::storeIn(PrimitiveStore& store) {
+	return store.addBox(this, min, max);
 }
 
-Vector aaBox::getNormal(Vector point)
+bool aaBox::intercepts(Ray& ray, HitRecord& hit)
 {
-	return Normal;
+	float t;
+	int face;
+
+	if (!intersect_box(min.x, min.y, min.z, max.x, max.y, max.z, ray, t, face) || t >= hit.t) return false;
+
+	// outward normal of the face
+	Vector normal = Vector(0, 0, 0);
+	normal.setAxisValue(face % 3, face < 3 ? -1.0f : 1.0f);
+	hit.set(t, this, normal);
+	return true;
 }
 
 Scene::Scene()
@@ -243,6 +407,11 @@ Scene::Scene()
 
 Scene::~Scene()
 {
+	for (Instance* instance : instances)
+		delete instance;
+	for (Mesh* mesh : meshes)
+		delete mesh;
+
 	/*for ( int i = 0; i < objects.size(); i++ )
 	{
 		delete objects[i];
@@ -513,21 +682,23 @@ bool Scene::load_p3f(const char *name)
 		  }
       }
       
-	  else if (cmd == "mesh") {
+	  else if (cmd == "mesh" || cmd == "meshdef") {  // meshdef: same data, but the mesh is only drawn by its instances
 		  unsigned total_vertices, total_faces;
 		  unsigned P0, P1, P2;
-		  Triangle* triangle;
-		  Vector* verticesArray, vertex;
+		  vector<Vector> vertices;
+		  vector<uint32_t> indices;
+		  Vector vertex;
 
 		  file >> total_vertices >> total_faces;
-		  verticesArray = (Vector*)malloc(total_vertices * sizeof(Vector));
+		  vertices.reserve(total_vertices);
 		  for (int i = 0; i < total_vertices; i++) {
 			  file >> vertex;
-			  verticesArray[i] = vertex;
+			  vertices.push_back(vertex);
 		  }
+		  indices.reserve(3 * total_faces);
 		  for (int i = 0; i < total_faces; i++) {
 			  file >> P0 >> P1 >> P2;
-			  if (P0 > 0) {
+			  if (P0 > 0) {  //vertex index start at 1
 				  P0 -= 1;
 				  P1 -= 1;
 				  P2 -= 1;
@@ -537,11 +708,51 @@ bool Scene::load_p3f(const char *name)
 				  P1 += total_vertices;
 				  P2 += total_vertices;
 			  }
-			  triangle = new Triangle(verticesArray[P0], verticesArray[P1], verticesArray[P2]); //vertex index start at 1
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject((Object*)triangle);
+			  if (P0 >= total_vertices || P1 >= total_vertices || P2 >= total_vertices) {
+				  cerr << "Mesh face " << i << " has a vertex index out of range.\n";
+				  continue;
+			  }
+			  indices.push_back(P0);
+			  indices.push_back(P1);
+			  indices.push_back(P2);
+		  }
+
+		  TriangleMesh* geometry = new TriangleMesh(vertices, indices, material);
+		  Mesh* mesh = new Mesh(geometry);
+
+		  if (cmd == "mesh")
+			  for (int i = 0; i < geometry->getNumFaces(); i++)
+				  this->addObject((Object*)geometry->getFace(i));
+		  meshes.push_back(mesh);
+	  }
+
+	  else if (cmd == "instance")  // copy of a mesh: instance <mesh index, -1 for the last one> translate x y z rotate x y z (degrees) scale x y z
+	  {
+		  int index;
+		  Vector translate, rotate, scale;
+
+		  file >> index;
+
+		  next_token(file, token, "translate");
+		  file >> translate;
+
+		  next_token(file, token, "rotate");
+		  file >> rotate;
+
+		  next_token(file, token, "scale");
+		  file >> scale;
+
+		  if (index < 0) index += meshes.size();
+		  if (index < 0 || index >= (int)meshes.size())
+		  {
+			  cerr << "Unknown mesh " << index << " in instance.\n";
+			  break;
 		  }
 
+		  Instance* instance = new Instance(meshes[index], Transform::compose(translate, rotate, scale));
+		  if (material) instance->SetMaterial(material);
+		  this->addObject((Object*)instance);
+		  instances.push_back(instance);
 	  }
 
 	  else if (cmd == "pl")  // General Plane
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <cmath>
+#include <cstdint>
 #include <IL/il.h>
 using namespace std;
 
@@ -13,7 +14,7 @@ using namespace std;
 #include "boundingBox.h"
 
 //Type of acceleration structure
-typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
+typedef enum { NONE, GRID_ACC, BVH_ACC, LBVH_ACC, SBVH_ACC, KD_ACC }  accelerator;  // LBVH_ACC, SBVH_ACC: BVH with the linear or the spatial split builder
 
 //Skybox images constant symbolics
 typedef enum { RIGHT, LEFT, TOP, BOTTOM, FRONT, BACK } CubeMap;
@@ -62,15 +63,39 @@ public:
 	Color color;
 };
 
+class Object;
+class PrimitiveStore;
+struct PrimRef;
+
+// Closest hit of a ray, filled by the intersection test that finds it, so shading needs no
+// other call into the primitive
+struct HitRecord
+{
+	float t = FLT_MAX;  // distance along the ray; the tests only accept hits closer than this
+	Object* prim = NULL;  // object hit, whose material shades the hit
+	Vector normal;  // geometric normal, normalized, on the outer side of the primitive
+	float u = 0.0f, v = 0.0f;  // barycentric weights of the second and third vertices on triangles; 0 on other primitives
+
+	void set(float t_, Object* prim_, const Vector& normal_, float u_ = 0.0f, float v_ = 0.0f) {
+		t = t_; prim = prim_; normal = normal_; u = u_; v = v_;
+	}
+};
+
 class Object
 {
 public:
+	virtual ~Object() {}
 
 	Material* GetMaterial() { return m_Material; }
 	void SetMaterial( Material *a_Mat ) { m_Material = a_Mat; }
 	virtual bool intercepts( Ray& r, float& dist ) = 0;
-	virtual Vector getNormal( Vector point ) = 0;
+	virtual bool intercepts( Ray& r, HitRecord& hit ) = 0;  // fills hit with a hit closer than hit.t, if any
+	virtual PrimRef storeIn(PrimitiveStore& store);  // adds the primitive data that acceleration structures traverse
 	virtual AABB GetBoundingBox() { return AABB(); }
+	virtual bool isBounded() { return true; }  // false: GetBoundingBox is infinite and acceleration structures test the object apart
+	virtual AABB GetClippedBoundingBox(AABB& box);  // bounds of the part of the object inside box; min > max if none
+	virtual bool OverlapsBox(AABB& box);  // false only if no part of the object is inside box
+	virtual unsigned int getGeometry(float* /*data*/) { return 0; }  // copies the up to 9 floats of the shape, if the bounds do not define it, and returns how many
 	Vector getCentroid(void) { return GetBoundingBox().centroid(); }
 
 protected:
@@ -89,7 +114,9 @@ public:
 		 Plane		(Vector& P0, Vector& P1, Vector& P2);
 
 		 bool intercepts( Ray& r, float& dist );
-         Vector getNormal(Vector point);
+		 bool intercepts( Ray& r, HitRecord& hit );
+		 AABB GetBoundingBox(void);
+		 bool isBounded() { return false; }
 };
 
 class Triangle : public Object
@@ -98,15 +125,61 @@ class Triangle : public Object
 public:
 	Triangle	(Vector& P0, Vector& P1, Vector& P2);
 	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts(Ray& r, float& t, float& u, float& v);  // u, v: barycentric weights of P1 and P2
+	bool intercepts(Ray& r, HitRecord& hit);
 	AABB GetBoundingBox(void);
+	AABB GetClippedBoundingBox(AABB& box);
+	bool OverlapsBox(AABB& box);
+	PrimRef storeIn(PrimitiveStore& store);
+	unsigned int getGeometry(float* data);
 	
 protected:
 	Vector points[3];
+	Vector edge1, edge2;  // P1 - P0 and P2 - P0, for the intersection
 	Vector normal;
 	Vector Min, Max;
 };
 
+class TriangleMesh;
+
+// Face of an indexed mesh, as acceleration structures hold it: just the (mesh, face) ids, with
+// the vertices read from the buffer of the mesh when the face is tested.
+class MeshTriangle : public Object
+{
+public:
+	MeshTriangle(TriangleMesh* mesh_, uint32_t face_) : mesh(mesh_), face(face_) {}
+	bool intercepts(Ray& r, float& t);
+	bool intercepts(Ray& r, float& t, float& u, float& v);  // u, v: barycentric weights of the second and third vertices
+	bool intercepts(Ray& r, HitRecord& hit);
+	AABB GetBoundingBox(void);
+	AABB GetClippedBoundingBox(AABB& box);
+	bool OverlapsBox(AABB& box);
+	PrimRef storeIn(PrimitiveStore& store);
+	unsigned int getGeometry(float* data);
+	TriangleMesh* getMesh() { return mesh; }
+	uint32_t getFace() { return face; }
+
+private:
+	TriangleMesh* mesh;
+	uint32_t face;
+};
+
+// Triangles of a p3f mesh command: one vertex buffer shared by all the faces, which are three
+// 32-bit vertex indices each. The faces are stored contiguously and never move once built.
+class TriangleMesh
+{
+public:
+	TriangleMesh(vector<Vector>& vertices_, vector<uint32_t>& indices_, Material* material);  // takes the contents of both vectors
+	int getNumFaces() { return faces.size(); }
+	MeshTriangle* getFace(uint32_t face) { return &faces[face]; }
+	Vector& getVertex(uint32_t face, int corner) { return vertices[indices[3 * face + corner]]; }
+
+private:
+	vector<Vector> vertices;
+	vector<uint32_t> indices;
+	vector<MeshTriangle> faces;
+};
+
 
 class Sphere : public Object
 {
@@ -116,8 +189,11 @@ public:
 		radius( a_radius ) {};
 
 	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts( Ray& r, HitRecord& hit);
 	AABB GetBoundingBox(void);
+	bool OverlapsBox(AABB& box);
+	PrimRef storeIn(PrimitiveStore& store);
+	unsigned int getGeometry(float* data);
 
 private:
 	Vector center;
@@ -130,16 +206,19 @@ public:
 	aaBox(Vector& minPoint, Vector& maxPoint);
 	AABB GetBoundingBox(void);
 	bool intercepts(Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts(Ray& r, HitRecord& hit);
+
+	PrimRef storeIn(PrimitiveStore& store);
 
 private:
 	Vector min;
 	Vector max;
-
-	Vector Normal;
 };
 
 
+class Mesh;
+class Instance;
+
 class Scene
 {
 public:
@@ -164,6 +243,9 @@ public:
 	void addObject( Object* o );
 	Object* getObject( unsigned int index );
 	
+	int getNumMeshes() { return meshes.size(); }
+	Mesh* getMesh(unsigned int index) { return meshes[index]; }  // in the order of the mesh commands
+
 	int getNumLights( );
 	void addLight( Light* l );
 	Light* getLight( unsigned int index );
@@ -173,6 +255,8 @@ public:
 	
 private:
 	vector<Object *> objects;
+	vector<Mesh *> meshes;  // own the geometry of the mesh commands, for instancing; the triangles of mesh commands are also in objects, those of meshdef commands are not
+	vector<Instance *> instances;  // also in objects; the scene deletes them and the meshes
 	vector<Light *> lights;
 
 	Camera* camera;
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include "tileScheduler.h"
+
+TileScheduler::TileScheduler(int res_x_, int res_y_, int tile_size_, int n_threads_) :
+	res_x(res_x_), res_y(res_y_), tile_size(tile_size_), n_threads(n_threads_)
+{
+	if (n_threads <= 0) n_threads = thread::hardware_concurrency();
+	if (n_threads <= 0) n_threads = 1;
+
+	int tiles_x = (res_x + tile_size - 1) / tile_size;
+	int tiles_y = (res_y + tile_size - 1) / tile_size;
+	n_tiles = tiles_x * tiles_y;
+
+	for (int i = 0; i < n_threads; i++)
+		queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+}
+
+// pop: the owner takes the tile at the back of its own deque
+bool TileScheduler::pop(int worker, Tile& tile) {
+	WorkQueue& q = *queues[worker];
+	lock_guard<mutex> guard(q.lock);
+
+	if (q.tiles.empty()) return false;
+	tile = q.tiles.back();
+	q.tiles.pop_back();
+	return true;
+}
+
+// steal: an idle worker takes the tile at the front of another worker's deque,
+// which is the farthest away from what the owner is currently rendering
+bool TileScheduler::steal(int thief, Tile& tile) {
+	for (int i = 1; i < n_threads; i++) {
+		WorkQueue& q = *queues[(thief + i) % n_threads];
+		lock_guard<mutex> guard(q.lock);
+
+		if (!q.tiles.empty()) {
+			tile = q.tiles.front();
+			q.tiles.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+// No tile is ever added during Run, so once a worker finds every deque empty the frame is done for it
+void TileScheduler::worker_loop(int worker, const function<void(const Tile&)>& render_tile) {
+	Tile tile;
+
+	while (pop(worker, tile) || steal(worker, tile))
+		render_tile(tile);
+}
+
+void TileScheduler::Run(const function<void(const Tile&)>& render_tile) {
+	int tiles_x = (res_x + tile_size - 1) / tile_size;
+
+	// deal contiguous runs of tiles to each worker; pushed in reverse so the owner pops them in scanline order
+	for (int w = 0; w < n_threads; w++) {
+		int first = (int)((long long)n_tiles * w / n_threads);
+		int last = (int)((long long)n_tiles * (w + 1) / n_threads);
+
+		for (int t = last - 1; t >= first; t--) {
+			Tile tile;
+			tile.x0 = (t % tiles_x) * tile_size;
+			tile.y0 = (t / tiles_x) * tile_size;
+			tile.x1 = min(tile.x0 + tile_size, res_x);
+			tile.y1 = min(tile.y0 + tile_size, res_y);
+			queues[w]->tiles.push_back(tile);
+		}
+	}
+
+	// the calling thread works as worker 0
+	vector<thread> workers;
+	for (int w = 1; w < n_threads; w++)
+		workers.push_back(thread(&TileScheduler::worker_loop, this, w, cref(render_tile)));
+
+	worker_loop(0, render_tile);
+
+	for (auto& t : workers)
+		t.join();
+}
@@ -0,0 +1,47 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <functional>
+
+using namespace std;
+
+// Rectangle of pixels [x0, x1[ x [y0, y1[ rendered as one unit of work
+struct Tile {
+	int x0, y0;
+	int x1, y1;
+};
+
+// Splits the frame in tiles and renders them with one worker per core.
+// Each worker owns a deque of tiles: it pops its own work from the back and,
+// once it runs dry, steals from the front of the other workers' deques, so
+// cheap regions (skybox) and expensive ones (glass spheres) even out.
+class TileScheduler
+{
+public:
+	TileScheduler(int res_x, int res_y, int tile_size, int n_threads = 0);  // n_threads = 0: one per hardware thread
+
+	int getNumThreads() { return n_threads; }
+	int getNumTiles() { return n_tiles; }
+	void Run(const function<void(const Tile&)>& render_tile);  // blocks until every tile was rendered
+
+private:
+	struct WorkQueue {
+		mutex lock;
+		deque<Tile> tiles;
+	};
+
+	bool pop(int worker, Tile& tile);
+	bool steal(int thief, Tile& tile);
+	void worker_loop(int worker, const function<void(const Tile&)>& render_tile);
+
+	int res_x, res_y, tile_size;
+	int n_threads, n_tiles;
+	vector<unique_ptr<WorkQueue> > queues;
+};
+
+#endif
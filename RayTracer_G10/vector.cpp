@@ -16,6 +16,12 @@ float Vector::getAxisValue(int axis) {
 	return (axis == 0) ? x : (axis == 1) ? y : z;
 }
 
+void Vector::setAxisValue(int axis, float value) {
+	if (axis == 0) x = value;
+	else if (axis == 1) y = value;
+	else z = value;
+}
+
 // --------------------------------------------------------------------- copy constructor
 Vector::Vector(const Vector& v)
 {
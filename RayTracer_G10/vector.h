@@ -16,6 +16,7 @@ public:
 	float length();
 
 	float getAxisValue(int axis);
+	void setAxisValue(int axis, float value);
 
 	Vector&	normalize();
 	Vector operator=(const Vector& v);